@@ -50,6 +50,16 @@ extern int s3bd_truncate(const char *path, off_t offset);
 extern int s3bd_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi);
 extern int s3bd_utimens(const char *path, const struct timespec tv[2]);
 extern int s3bd_statfs(const char *path, struct statvfs *buf);
+extern void s3bd_destroy(void *private_data);
+
+/* Zero-copy access to the device, for frontends that can use it: a
+ * pinned span can be read from or written to the returned descriptor
+ * at the returned offset until it is unpinned.  -EAGAIN means that the
+ * span must go through s3bd_read or s3bd_write instead. */
+extern int s3bd_read_pin(const char *path, size_t size, off_t offset, int *fd, off_t *fd_offset);
+extern void s3bd_read_unpin(const char *path, size_t size, off_t offset);
+extern int s3bd_write_pin(const char *path, size_t size, off_t offset, int *fd, off_t *fd_offset);
+extern void s3bd_write_unpin(const char *path, size_t size, off_t offset, int written);
 
 extern int64_t device_size;
 extern int64_t block_size;
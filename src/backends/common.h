@@ -81,10 +81,38 @@ int s3bd_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
 }
 #endif
 
+#ifndef NO_S3BD_GETXATTR
 int s3bd_getxattr(const char *path, const char *name, char *value, size_t size)
 {
     return -ENOTSUP;
 }
+#endif
+
+#ifndef NO_S3BD_DESTROY
+void s3bd_destroy(void *private_data)
+{
+}
+#endif
+
+#ifndef NO_S3BD_PIN
+int s3bd_read_pin(const char *path, size_t size, off_t offset, int *fd, off_t *fd_offset)
+{
+    return -EAGAIN;
+}
+
+void s3bd_read_unpin(const char *path, size_t size, off_t offset)
+{
+}
+
+int s3bd_write_pin(const char *path, size_t size, off_t offset, int *fd, off_t *fd_offset)
+{
+    return -EAGAIN;
+}
+
+void s3bd_write_unpin(const char *path, size_t size, off_t offset, int written)
+{
+}
+#endif
 
 int s3bd_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
 {
@@ -0,0 +1,138 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <vector>
+
+#include "constants.h"
+#include "storage.h"
+
+constexpr uint64_t BENCHMARK_EXTENTS = 16;
+constexpr double BENCHMARK_SECONDS = 1.0;
+
+static volatile bool benchmark_continue = false;
+
+typedef struct
+{
+    unsigned int seed;
+    bool write;
+    uint64_t bytes;
+} benchmark_thread_t;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec * 1e-9);
+}
+
+/**
+ * Issue random page-sized reads or writes against resident extents
+ * until told to stop.
+ *
+ * @param arg A pointer to a benchmark_thread_t
+ * @return Always nullptr
+ */
+void *benchmark_thread(void *arg)
+{
+    auto state = reinterpret_cast<benchmark_thread_t *>(arg);
+    uint8_t page[PAGE_SIZE];
+
+    memset(page, 0x5a, PAGE_SIZE);
+    while (benchmark_continue)
+    {
+        uint64_t page_number = rand_r(&state->seed) % (BENCHMARK_EXTENTS * PAGES_PER_EXTENT);
+        off_t offset = page_number * PAGE_SIZE;
+        int bytes = state->write ? storage_write(offset, PAGE_SIZE, page) : storage_read(offset, PAGE_SIZE, page);
+        if (bytes > 0)
+        {
+            state->bytes += bytes;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Measure throughput with a given number of threads.
+ *
+ * @param threads The number of threads
+ * @param write Whether to write rather than read
+ * @return The throughput in MiB/s
+ */
+double benchmark(size_t threads, bool write)
+{
+    std::vector<pthread_t> handles(threads);
+    std::vector<benchmark_thread_t> states(threads);
+    uint64_t bytes = 0;
+    double start;
+
+    benchmark_continue = true;
+    start = now();
+    for (size_t i = 0; i < threads; ++i)
+    {
+        states[i] = benchmark_thread_t{static_cast<unsigned int>(i + 1), write, 0};
+        pthread_create(&handles[i], NULL, benchmark_thread, &states[i]);
+    }
+    usleep(BENCHMARK_SECONDS * 1e6);
+    benchmark_continue = false;
+    for (size_t i = 0; i < threads; ++i)
+    {
+        pthread_join(handles[i], nullptr);
+        bytes += states[i].bytes;
+    }
+    return (bytes / (now() - start)) / (1 << 20);
+}
+
+int main(int argc, char **argv)
+{
+    const char *blockdir = (argc > 1) ? argv[1] : "/vsimem/benchmark";
+    uint8_t *extent = new uint8_t[EXTENT_SIZE];
+
+    // Make the extents resident in the scratch file
+    storage_init(blockdir);
+    memset(extent, 0xa5, EXTENT_SIZE);
+    for (uint64_t i = 0; i < BENCHMARK_EXTENTS; ++i)
+    {
+        storage_write(i * EXTENT_SIZE, EXTENT_SIZE, extent);
+    }
+    delete[] extent;
+
+    fprintf(stdout, "threads\tread MiB/s\twrite MiB/s\n");
+    for (size_t threads = 1; threads <= 32; threads *= 2)
+    {
+        double read = benchmark(threads, false);
+        double write = benchmark(threads, true);
+        fprintf(stdout, "%lu\t%.1f\t\t%.1f\n", threads, read, write);
+    }
+
+    storage_deinit();
+    return 0;
+}
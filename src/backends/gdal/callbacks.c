@@ -33,6 +33,7 @@
 #include "../backend.h"
 
 static const char *device_name = "/blocks";
+static const char *metric_prefix = "user.s3bd.";
 
 int64_t device_size;
 int64_t block_size;
@@ -43,7 +44,13 @@ bool initialized = false;
 #define NO_S3BD_OPEN
 #define NO_S3BD_FLUSH
 #define NO_S3BD_FSYNC
+#define NO_S3BD_GETXATTR
+#define NO_S3BD_DESTROY
+#define NO_S3BD_PIN
 #include "../common.h"
+#undef NO_S3BD_PIN
+#undef NO_S3BD_DESTROY
+#undef NO_S3BD_GETXATTR
 #undef NO_S3BD_FSYNC
 #undef NO_S3BD_FLUSH
 #undef NO_S3BD_OPEN
@@ -69,19 +76,85 @@ int s3bd_open(const char *path, struct fuse_file_info *fi)
 
     if (initialized != true)
     {
-        storage_init(blockdir);
+        if (!storage_init(blockdir))
+            return -EIO;
         initialized = true;
     }
 
     return 0;
 }
 
+void s3bd_destroy(void *private_data)
+{
+    if (initialized == true)
+    {
+        storage_deinit();
+        initialized = false;
+    }
+}
+
 int s3bd_flush(const char *path, struct fuse_file_info *fi)
 {
-    return 0;
+    return storage_sync();
 }
 
 int s3bd_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
 {
-    return 0;
+    return storage_sync();
+}
+
+int s3bd_read_pin(const char *path, size_t size, off_t offset, int *fd, off_t *fd_offset)
+{
+    if (strcmp(path, device_name))
+        return -ENOENT;
+
+    return storage_read_pin(offset, size, fd, fd_offset) ? 0 : -EAGAIN;
+}
+
+void s3bd_read_unpin(const char *path, size_t size, off_t offset)
+{
+    storage_read_unpin(offset);
+}
+
+int s3bd_write_pin(const char *path, size_t size, off_t offset, int *fd, off_t *fd_offset)
+{
+    int res;
+
+    if (strcmp(path, device_name))
+        return -ENOENT;
+
+    res = storage_write_pin(offset, size, fd, fd_offset);
+    return (res > 0) ? 0 : (res == 0) ? -EAGAIN : res;
+}
+
+void s3bd_write_unpin(const char *path, size_t size, off_t offset, int written)
+{
+    storage_write_unpin(offset, size, written);
+}
+
+/*
+ * Counters are exposed as extended attributes of the device, so that
+ * (for example) "getfattr -n user.s3bd.readahead_hits /mnt/blocks"
+ * reports the number of read-ahead hits.
+ */
+int s3bd_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    char str[0x20];
+    uint64_t metric;
+    size_t len;
+
+    if (strcmp(path, device_name))
+        return -ENOENT;
+
+    len = strlen(metric_prefix);
+    if (strncmp(name, metric_prefix, len) || !storage_metric(name + len, &metric))
+        return -ENODATA;
+
+    len = sprintf(str, "%lu", metric);
+    if (size == 0)
+        return len;
+    if (size < len)
+        return -ERANGE;
+    memcpy(value, str, len);
+    return len;
 }
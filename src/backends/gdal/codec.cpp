@@ -0,0 +1,304 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(HAVE_LZ4)
+#include <lz4.h>
+#endif
+
+#include <algorithm>
+
+#include "constants.h"
+#include "codec.h"
+
+static const char codec_magic[4] = {'S', '3', 'B', 'D'};
+static const char *codec_names[] = {"none", "zstd", "lz4"};
+static int codec = CODEC_NONE;
+
+/**
+ * Whether a codec was compiled in.
+ *
+ * @param c The codec
+ * @return True if objects using it can be encoded and decoded
+ */
+static bool codec_available(int c)
+{
+    switch (c)
+    {
+    case CODEC_NONE:
+        return true;
+#if defined(HAVE_ZSTD)
+    case CODEC_ZSTD:
+        return true;
+#endif
+#if defined(HAVE_LZ4)
+    case CODEC_LZ4:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/**
+ * Initialize the codec.  The codec used for storing extents is chosen
+ * by the S3BD_COMPRESSION environment variable ("none", "zstd", or
+ * "lz4").  A codec that was not compiled in is treated as "none".
+ * Objects written with any compiled-in codec can always be read.
+ */
+void codec_init()
+{
+    const char *str = getenv(S3BD_COMPRESSION);
+
+    codec = CODEC_NONE;
+    for (int c = 0; str != nullptr && c < static_cast<int>(sizeof(codec_names) / sizeof(codec_names[0])); ++c)
+    {
+        if (strcmp(str, codec_names[c]) == 0 && codec_available(c))
+        {
+            codec = c;
+        }
+    }
+}
+
+/**
+ * The largest object that codec_encode can produce.
+ *
+ * @return The size in bytes
+ */
+size_t codec_bound()
+{
+    size_t bound = EXTENT_SIZE;
+
+#if defined(HAVE_ZSTD)
+    bound = std::max(bound, ZSTD_compressBound(EXTENT_SIZE));
+#endif
+#if defined(HAVE_LZ4)
+    bound = std::max(bound, static_cast<size_t>(LZ4_compressBound(EXTENT_SIZE)));
+#endif
+    return CODEC_HEADER_SIZE + bound;
+}
+
+static void codec_put32(uint8_t *bytes, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        bytes[i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+}
+
+static uint32_t codec_get32(const uint8_t *bytes)
+{
+    uint32_t value = 0;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        value |= static_cast<uint32_t>(bytes[i]) << (8 * i);
+    }
+    return value;
+}
+
+/**
+ * Compress an extent.
+ *
+ * @param c The codec
+ * @param extent The extent, EXTENT_SIZE bytes
+ * @param payload The array in which to return the compressed bytes
+ * @param capacity The size of that array
+ * @return The number of compressed bytes, or 0 on failure
+ */
+static size_t codec_compress(int c, const uint8_t *extent, uint8_t *payload, size_t capacity)
+{
+    switch (c)
+    {
+#if defined(HAVE_ZSTD)
+    case CODEC_ZSTD:
+    {
+        size_t result = ZSTD_compress(payload, capacity, extent, EXTENT_SIZE, 3);
+        return ZSTD_isError(result) ? 0 : result;
+    }
+#endif
+#if defined(HAVE_LZ4)
+    case CODEC_LZ4:
+    {
+        int result = LZ4_compress_default(reinterpret_cast<const char *>(extent),
+                                          reinterpret_cast<char *>(payload),
+                                          EXTENT_SIZE,
+                                          capacity);
+        return (result <= 0) ? 0 : result;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Decompress an extent.
+ *
+ * @param c The codec
+ * @param payload The compressed bytes
+ * @param payload_size The number of compressed bytes
+ * @param extent The array in which to return the extent, EXTENT_SIZE bytes
+ * @return A boolean indicating success or failure
+ */
+static bool codec_decompress(int c, const uint8_t *payload, size_t payload_size, uint8_t *extent)
+{
+    switch (c)
+    {
+    case CODEC_ZERO:
+        memset(extent, 0, EXTENT_SIZE);
+        return (payload_size == 0);
+#if defined(HAVE_ZSTD)
+    case CODEC_ZSTD:
+        return ZSTD_decompress(extent, EXTENT_SIZE, payload, payload_size) == EXTENT_SIZE;
+#endif
+#if defined(HAVE_LZ4)
+    case CODEC_LZ4:
+        return LZ4_decompress_safe(reinterpret_cast<const char *>(payload),
+                                   reinterpret_cast<char *>(extent),
+                                   payload_size,
+                                   EXTENT_SIZE) == static_cast<int>(EXTENT_SIZE);
+#endif
+    default:
+        return false;
+    }
+}
+
+/**
+ * Encode an extent with the configured codec.  An extent of zeros is
+ * always encoded as a header with no payload, whatever the codec.
+ *
+ * @param extent The extent, EXTENT_SIZE bytes
+ * @param object The array in which to return the object, codec_bound() bytes
+ * @return The size of the object, or 0 if the extent should be stored raw
+ */
+size_t codec_encode(const uint8_t *extent, uint8_t *object)
+{
+    int c = codec_zero(extent, EXTENT_SIZE) ? CODEC_ZERO : codec;
+    size_t payload_size = 0;
+
+    if (c != CODEC_ZERO)
+    {
+        payload_size = codec_compress(c, extent, object + CODEC_HEADER_SIZE, codec_bound() - CODEC_HEADER_SIZE);
+
+        // An object the size of an extent would be mistaken for a raw
+        // one, and one that is no smaller is not worth decoding
+        if (payload_size == 0 || CODEC_HEADER_SIZE + payload_size >= EXTENT_SIZE)
+        {
+            return 0;
+        }
+    }
+
+    memcpy(object, codec_magic, sizeof(codec_magic));
+    object[4] = CODEC_VERSION;
+    object[5] = static_cast<uint8_t>(c);
+    object[6] = object[7] = 0;
+    codec_put32(object + 8, EXTENT_SIZE);
+    codec_put32(object + 12, payload_size);
+
+    return CODEC_HEADER_SIZE + payload_size;
+}
+
+/**
+ * Decode an object into an extent.
+ *
+ * @param object The object
+ * @param object_size The size of the object
+ * @param extent The array in which to return the extent, EXTENT_SIZE bytes
+ * @return A boolean indicating success or failure
+ */
+bool codec_decode(const uint8_t *object, size_t object_size, uint8_t *extent)
+{
+    // Raw extents have no header
+    if (object_size == EXTENT_SIZE)
+    {
+        memcpy(extent, object, EXTENT_SIZE);
+        return true;
+    }
+
+    if (object_size < CODEC_HEADER_SIZE ||
+        memcmp(object, codec_magic, sizeof(codec_magic)) != 0 ||
+        object[4] != CODEC_VERSION ||
+        codec_get32(object + 8) != EXTENT_SIZE ||
+        codec_get32(object + 12) != object_size - CODEC_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    return codec_decompress(object[5], object + CODEC_HEADER_SIZE, object_size - CODEC_HEADER_SIZE, extent);
+}
+
+/**
+ * Check whether an array contains only zeros.  This uses SSE2 where it
+ * is available, looking at 64 bytes per iteration.
+ *
+ * @param bytes The array
+ * @param size The size of the array
+ * @return True if every byte is zero
+ */
+bool codec_zero(const uint8_t *bytes, size_t size)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= size; i += 64)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i + 0x00));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i + 0x10));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i + 0x20));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i + 0x30));
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xffff)
+        {
+            return false;
+        }
+    }
+#endif
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        if (word != 0)
+        {
+            return false;
+        }
+    }
+    for (; i < size; ++i)
+    {
+        if (bytes[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
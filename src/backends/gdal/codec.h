@@ -0,0 +1,52 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <cstddef>
+#include <cstdint>
+
+enum
+{
+    CODEC_NONE = 0,
+    CODEC_ZSTD = 1,
+    CODEC_LZ4 = 2,
+    CODEC_ZERO = 3 // No payload; the extent is all zeros
+};
+
+// Encoded objects begin with a header: the magic bytes "S3BD", a
+// version byte, a codec byte, two reserved bytes, then the decoded and
+// encoded sizes as little-endian 32-bit integers.  Objects that are
+// exactly EXTENT_SIZE bytes long are raw extents and have no header.
+constexpr size_t CODEC_HEADER_SIZE = 16;
+constexpr uint8_t CODEC_VERSION = 1;
+
+void codec_init();
+size_t codec_bound();
+size_t codec_encode(const uint8_t *extent, uint8_t *object);
+bool codec_decode(const uint8_t *object, size_t object_size, uint8_t *extent);
+bool codec_zero(const uint8_t *bytes, size_t size);
+
+#endif
@@ -30,18 +30,65 @@
 
 constexpr uint64_t PAGE_SIZE = 0x1000;
 constexpr uint64_t PAGE_MASK = (PAGE_SIZE - 1);
-constexpr uint64_t PAGES_PER_EXTENT = (1 << 10);
-constexpr uint64_t EXTENT_SIZE = PAGE_SIZE * PAGES_PER_EXTENT;
-constexpr uint64_t EXTENT_MASK = (EXTENT_SIZE - 1);
+constexpr uint64_t EXTENT_DEFAULT_PAGES = (1 << 10);
+constexpr uint64_t EXTENT_MIN_PAGES = (1 << 6);
+constexpr uint64_t EXTENT_MAX_PAGES = (1 << 16);
 constexpr size_t LOCAL_CACHE_DEFAULT_MEGABYTES = 4096;
 constexpr size_t EXTENT_BUCKETS = (1 << 8);
-constexpr size_t SCRATCH_DESCRIPTORS = (1 << 6);
+constexpr size_t FLUSH_WORKERS_DEFAULT = 4;
+constexpr uint64_t FETCH_DEFAULT_PAGES = (1 << 4);
+constexpr uint64_t DIRTY_IDLE_DEFAULT_CENTISECS = 500;
+constexpr uint64_t DIRTY_EXPIRE_DEFAULT_CENTISECS = 3000;
+constexpr uint64_t WRITEBACK_INTERVAL_CENTISECS = 100;
+constexpr uint64_t DIRTY_BACKGROUND_DEFAULT_RATIO = 10;
+constexpr uint64_t DIRTY_DEFAULT_RATIO = 20;
+constexpr uint64_t DIRTY_THROTTLE_MAX_MILLISECS = 100;
+constexpr size_t READAHEAD_DEFAULT_EXTENTS = 8;
+constexpr size_t READAHEAD_STREAMS = 8;
+constexpr size_t READAHEAD_TRIGGER = 2;
+constexpr size_t READAHEAD_WORKERS = 2;
+constexpr size_t LRU_SHARDS = (1 << 4);
+constexpr uint64_t LRU_HIT_BATCH = (1 << 6);
+constexpr uint64_t MANIFEST_CHUNK_EXTENTS = (1 << 15);
+constexpr size_t URING_ENTRIES = 64;
+
+// The extent geometry is fixed for each volume when it is mounted
+// (see volume.cpp)
+extern uint64_t PAGES_PER_EXTENT;
+extern uint64_t EXTENT_SIZE;
+extern uint64_t EXTENT_MASK;
+extern uint64_t EXTENT_SHIFT;
 
 #define EXTENT_TEMPLATE "%s/%016lX.extent"
+#define REF_TEMPLATE "%s/%016lX.ref"
+#define CAS_TEMPLATE "%s/%s.extent"
+#define CAS_DEFAULT_TEMPLATE "%s/cas"
+#define MANIFEST_TEMPLATE "%s/%08lX.manifest"
+#define MANIFEST_INDEX_TEMPLATE "%s/manifest"
+#define VOLUME_TEMPLATE "%s/volume"
+#define GENERATION_TEMPLATE "%s/generation"
 #define SCRATCH_TEMPLATE "%s/s3bd.%d"
+#define SCRATCH_PERSISTENT_TEMPLATE "%s/s3bd.%s"
+#define WARM_TEMPLATE "%s.warm"
 #define SCRATCH_DEFAULT_DIR "/tmp"
 #define S3BD_KEEP_SCRATCH_FILE "S3BD_KEEP_SCRATCH_FILE"
 #define S3BD_LOCAL_CACHE_MEGABYTES "S3BD_LOCAL_CACHE_MEGABYTES"
 #define S3BD_SCRATCH_DIR "S3BD_SCRATCH_DIR"
+#define S3BD_SCRATCH_MMAP "S3BD_SCRATCH_MMAP"
+#define S3BD_SCRATCH_URING "S3BD_SCRATCH_URING"
+#define S3BD_FLUSH_WORKERS "S3BD_FLUSH_WORKERS"
+#define S3BD_READAHEAD_EXTENTS "S3BD_READAHEAD_EXTENTS"
+#define S3BD_FETCH_PAGES "S3BD_FETCH_PAGES"
+#define S3BD_EVICTION_POLICY "S3BD_EVICTION_POLICY"
+#define S3BD_COMPRESSION "S3BD_COMPRESSION"
+#define S3BD_DEDUP "S3BD_DEDUP"
+#define S3BD_DEDUP_DIR "S3BD_DEDUP_DIR"
+#define S3BD_NO_MANIFEST "S3BD_NO_MANIFEST"
+#define S3BD_EXTENT_KILOBYTES "S3BD_EXTENT_KILOBYTES"
+#define S3BD_PERSISTENT_CACHE "S3BD_PERSISTENT_CACHE"
+#define S3BD_DIRTY_IDLE_CENTISECS "S3BD_DIRTY_IDLE_CENTISECS"
+#define S3BD_DIRTY_EXPIRE_CENTISECS "S3BD_DIRTY_EXPIRE_CENTISECS"
+#define S3BD_DIRTY_BACKGROUND_RATIO "S3BD_DIRTY_BACKGROUND_RATIO"
+#define S3BD_DIRTY_RATIO "S3BD_DIRTY_RATIO"
 
 #endif
@@ -0,0 +1,222 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <pthread.h>
+
+#include <cpl_sha256.h>
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "constants.h"
+#include "dedup.h"
+
+typedef std::map<uint64_t, std::string> dedup_hashes_t;
+typedef std::map<std::string, std::set<uint64_t>> dedup_tags_t;
+
+static bool dedup = false;
+static std::string *dedup_dir = nullptr;
+
+// Which clean, completely-present extents in the scratch file have
+// which contents
+static pthread_mutex_t dedup_local_lock = PTHREAD_MUTEX_INITIALIZER;
+static dedup_hashes_t *dedup_local_hashes = nullptr;
+static dedup_tags_t *dedup_local_tags = nullptr;
+
+/**
+ * Initialize deduplication.  If the S3BD_DEDUP environment variable
+ * is set, extents are stored by content under the directory given by
+ * S3BD_DEDUP_DIR (by default, "cas" under the storage directory),
+ * and each position in the volume holds a reference to its content.
+ * Volumes that share that directory share their extents.
+ *
+ * @param blockdir The storage directory
+ */
+void dedup_init(const char *blockdir)
+{
+    const char *str;
+    char dirname[0x100];
+
+    dedup = (getenv(S3BD_DEDUP) != nullptr);
+    if ((str = getenv(S3BD_DEDUP_DIR)) == nullptr)
+    {
+        sprintf(dirname, CAS_DEFAULT_TEMPLATE, blockdir);
+        str = dirname;
+    }
+    if (dedup_dir == nullptr)
+    {
+        dedup_dir = new std::string{str};
+        dedup_local_hashes = new dedup_hashes_t{};
+        dedup_local_tags = new dedup_tags_t{};
+    }
+}
+
+/**
+ * Deinitialize deduplication.
+ */
+void dedup_deinit()
+{
+    if (dedup_dir != nullptr)
+    {
+        delete dedup_dir;
+        delete dedup_local_hashes;
+        delete dedup_local_tags;
+        dedup_dir = nullptr;
+        dedup_local_hashes = nullptr;
+        dedup_local_tags = nullptr;
+    }
+    dedup = false;
+}
+
+/**
+ * Whether extents are stored by content.
+ *
+ * @return True if they are
+ */
+bool dedup_enabled()
+{
+    return dedup;
+}
+
+/**
+ * Compute the hash that names the contents of an extent.
+ *
+ * @param extent The extent, EXTENT_SIZE bytes
+ * @return The hash, as hexadecimal
+ */
+std::string dedup_hash(const uint8_t *extent)
+{
+    GByte hash[CPL_SHA256_HASH_SIZE];
+    char hex[2 * CPL_SHA256_HASH_SIZE + 1];
+
+    CPL_SHA256(extent, EXTENT_SIZE, hash);
+    for (int i = 0; i < CPL_SHA256_HASH_SIZE; ++i)
+    {
+        sprintf(hex + 2 * i, "%02x", hash[i]);
+    }
+    return std::string{hex};
+}
+
+/**
+ * The name of the object holding the extent with the given hash.
+ *
+ * @param hash The hash
+ * @return The name
+ */
+std::string dedup_object_name(const std::string &hash)
+{
+    char filename[0x200];
+
+    sprintf(filename, CAS_TEMPLATE, dedup_dir->c_str(), hash.c_str());
+    return std::string{filename};
+}
+
+/**
+ * Record that an extent is completely present in the scratch file,
+ * clean, and has the given hash.
+ *
+ * @param extent_tag The extent
+ * @param hash Its hash
+ */
+void dedup_local_insert(uint64_t extent_tag, const std::string &hash)
+{
+    if (!dedup)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&dedup_local_lock);
+    auto itr = dedup_local_hashes->find(extent_tag);
+    if (itr != dedup_local_hashes->end())
+    {
+        auto &tags = dedup_local_tags->operator[](itr->second);
+        tags.erase(extent_tag);
+        if (tags.empty())
+        {
+            dedup_local_tags->erase(itr->second);
+        }
+    }
+    dedup_local_hashes->operator[](extent_tag) = hash;
+    dedup_local_tags->operator[](hash).insert(extent_tag);
+    pthread_mutex_unlock(&dedup_local_lock);
+}
+
+/**
+ * Forget an extent that is about to change or leave the scratch file.
+ *
+ * @param extent_tag The extent
+ */
+void dedup_local_forget(uint64_t extent_tag)
+{
+    if (!dedup)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&dedup_local_lock);
+    auto itr = dedup_local_hashes->find(extent_tag);
+    if (itr != dedup_local_hashes->end())
+    {
+        auto &tags = dedup_local_tags->operator[](itr->second);
+        tags.erase(extent_tag);
+        if (tags.empty())
+        {
+            dedup_local_tags->erase(itr->second);
+        }
+        dedup_local_hashes->erase(itr);
+    }
+    pthread_mutex_unlock(&dedup_local_lock);
+}
+
+/**
+ * Find an extent in the scratch file with the given hash.
+ *
+ * @param hash The hash
+ * @param extent_tag The return pointer for the extent
+ * @return A boolean indicating whether one was found
+ */
+bool dedup_local_find(const std::string &hash, uint64_t *extent_tag)
+{
+    bool found = false;
+
+    if (!dedup)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&dedup_local_lock);
+    auto itr = dedup_local_tags->find(hash);
+    if (itr != dedup_local_tags->end() && !itr->second.empty())
+    {
+        *extent_tag = *(itr->second.begin());
+        found = true;
+    }
+    pthread_mutex_unlock(&dedup_local_lock);
+
+    return found;
+}
@@ -24,6 +24,7 @@
 
 #include <unistd.h>
 #include <assert.h>
+#include <time.h>
 
 #include <pthread.h>
 
@@ -33,12 +34,18 @@
 #include <vector>
 
 #include "constants.h"
+#include "metrics.h"
 #include "extent.h"
 
 typedef struct
 {
     bool dirty;
-    int refcount;
+    uint64_t dirtied_ns; // When the extent last became dirty
+    uint64_t written_ns; // When the extent was last locked for writing
+    int refcount;        // -1 if write locked, otherwise the number of read locks
+    int waiters;         // The number of threads waiting for a lock
+    int waiting_writers; // The number of those that want a write lock
+    pthread_cond_t cond; // Signalled when the lock becomes available
 } extent_entry_t;
 
 typedef std::map<uint64_t, extent_entry_t> extent_map_t;
@@ -55,7 +62,16 @@ typedef std::hash<uint64_t> extent_bucket_hash_t;
 
 static extent_bucket_hash_t extent_bucket_hash = extent_bucket_hash_t{};
 static extent_buckets_t *extent_buckets = nullptr;
-static std::atomic<size_t> moop{0};
+
+static metric_t &extent_lock_waits = metric_register("extent_lock_waits");
+static metric_t &extent_lock_wait_ns = metric_register("extent_lock_wait_ns");
+
+// Dirty data is accounted a whole extent at a time, because that is
+// how it is written back
+static metric_t &extent_dirty_bytes = metric_register("dirty_bytes");
+static pthread_mutex_t extent_dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t extent_dirty_cond = PTHREAD_COND_INITIALIZER; // Signalled when an extent becomes clean
+static std::atomic<int> extent_dirty_waiters{0};
 
 /**
  * Initialize extent tracking.
@@ -83,70 +99,155 @@ void extent_deinit()
     {
         delete extent_buckets;
         extent_buckets = nullptr;
+        extent_dirty_bytes = 0;
     }
 }
 
 /**
- * Get lock on an extent.
+ * Read the monotonic clock.
  *
- * @param extent_tag The tag of the extent
- * @param wrlock True if write lock requested, false if read lock requested
- * @return A boolean indicating success or failure
+ * @return The time in nanoseconds
  */
-bool extent_lock(uint64_t extent_tag, bool wrlock)
+uint64_t extent_now_ns()
 {
-    assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
+    struct timespec now;
 
-    auto index = extent_bucket_hash(extent_tag) % extent_buckets->size();
-    auto &bucket = extent_buckets->operator[](index);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000000L) + now.tv_nsec;
+}
 
-    pthread_mutex_lock(&bucket.lock);
+/**
+ * Get the entry for an extent, creating it if necessary.  The caller
+ * is assumed to hold the bucket lock.
+ *
+ * @param bucket The bucket responsible for the extent
+ * @param extent_tag The tag of the extent
+ * @return A reference to the entry
+ */
+static extent_entry_t &extent_entry(extent_bucket_t &bucket, uint64_t extent_tag)
+{
     auto itr = bucket.entries.find(extent_tag);
-    if (itr != bucket.entries.end()) // Existing entry
+    if (itr == bucket.entries.end())
     {
-        if ((wrlock && itr->second.refcount != 0) || (!wrlock && itr->second.refcount < 0)) // Cannot get write lock || write lock already held
-        {
-            pthread_mutex_unlock(&bucket.lock);
-            return false;
-        }
-        else // No write locks currently held
+        // "false" means "not dirty", "0" means "no locks held"
+        itr = bucket.entries.insert(std::make_pair(extent_tag, extent_entry_t{false, 0, 0, 0, 0, 0, PTHREAD_COND_INITIALIZER})).first;
+    }
+    return itr->second;
+}
+
+/**
+ * Answer whether a lock can be granted right now.  Readers give way
+ * to waiting writers so that a stream of readers cannot starve a
+ * writer.
+ *
+ * @param entry The entry for the extent
+ * @param wrlock True if write lock requested, false if read lock requested
+ * @return A boolean
+ */
+static inline bool extent_lock_available(const extent_entry_t &entry, bool wrlock)
+{
+    if (wrlock)
+    {
+        return (entry.refcount == 0);
+    }
+    else
+    {
+        return (entry.refcount >= 0 && entry.waiting_writers == 0);
+    }
+}
+
+/**
+ * Grant a lock.  The caller is assumed to hold the bucket lock.
+ *
+ * @param entry The entry for the extent
+ * @param wrlock True if write lock requested, false if read lock requested
+ * @param mark_dirty True if a write lock should mark the extent dirty
+ */
+static inline void extent_lock_grant(extent_entry_t &entry, bool wrlock, bool mark_dirty)
+{
+    if (wrlock) // Write lock
+    {
+        if (mark_dirty)
         {
-            if (wrlock) // Write lock
-            {
-                itr->second.dirty = true;
-                itr->second.refcount--;
-            }
-            else // Read lock
+            entry.written_ns = extent_now_ns();
+            if (!entry.dirty)
             {
-                itr->second.refcount++;
+                entry.dirtied_ns = entry.written_ns;
+                entry.dirty = true;
+                extent_dirty_bytes += EXTENT_SIZE;
             }
-            pthread_mutex_unlock(&bucket.lock);
-            return true;
         }
+        entry.refcount = -1;
     }
-    else // No existing entry, make one
+    else // Read lock
     {
-        if (wrlock) // Write lock
-        {
-            // "true" means "dirty", "-1" means "write lock held"
-            bucket.entries.insert(std::make_pair(extent_tag, extent_entry_t{true, -1}));
-        }
-        else // Read lock
-        {
-            // "false" means "not dirty", "+1" means "one read lock held"
-            bucket.entries.insert(std::make_pair(extent_tag, extent_entry_t{false, +1}));
-        }
-        pthread_mutex_unlock(&bucket.lock);
-        return true;
+        entry.refcount++;
+    }
+}
+
+/**
+ * Try to get a lock on an extent without waiting.
+ *
+ * @param extent_tag The tag of the extent
+ * @param wrlock True if write lock requested, false if read lock requested
+ * @param mark_dirty True if a write lock should mark the extent dirty
+ * @return A boolean indicating success or failure
+ */
+bool extent_lock(uint64_t extent_tag, bool wrlock, bool mark_dirty)
+{
+    assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
+
+    auto index = extent_bucket_hash(extent_tag) % extent_buckets->size();
+    auto &bucket = extent_buckets->operator[](index);
+    bool retval = false;
+
+    pthread_mutex_lock(&bucket.lock);
+    auto &entry = extent_entry(bucket, extent_tag);
+    if (extent_lock_available(entry, wrlock))
+    {
+        extent_lock_grant(entry, wrlock, mark_dirty);
+        retval = true;
     }
+    pthread_mutex_unlock(&bucket.lock);
+
+    return retval;
 }
 
-void extent_spinlock(uint64_t extent_tag, bool wrlock)
+/**
+ * Get a lock on an extent, sleeping until it is available.  Time
+ * spent waiting is accumulated in the extent_lock_wait_ns counter.
+ *
+ * @param extent_tag The tag of the extent
+ * @param wrlock True if write lock requested, false if read lock requested
+ * @param mark_dirty True if a write lock should mark the extent dirty
+ */
+void extent_lock_wait(uint64_t extent_tag, bool wrlock, bool mark_dirty)
 {
-    while (!extent_lock(extent_tag, wrlock))
+    assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
+
+    auto index = extent_bucket_hash(extent_tag) % extent_buckets->size();
+    auto &bucket = extent_buckets->operator[](index);
+
+    pthread_mutex_lock(&bucket.lock);
+    auto &entry = extent_entry(bucket, extent_tag);
+    if (!extent_lock_available(entry, wrlock))
     {
-        sleep(0);
+        uint64_t start = extent_now_ns();
+
+        entry.waiters++;
+        entry.waiting_writers += wrlock ? 1 : 0;
+        while (!extent_lock_available(entry, wrlock))
+        {
+            pthread_cond_wait(&entry.cond, &bucket.lock);
+        }
+        entry.waiting_writers -= wrlock ? 1 : 0;
+        entry.waiters--;
+
+        extent_lock_waits++;
+        extent_lock_wait_ns += extent_now_ns() - start;
     }
+    extent_lock_grant(entry, wrlock, mark_dirty);
+    pthread_mutex_unlock(&bucket.lock);
 }
 
 /**
@@ -166,6 +267,10 @@ void extent_lock_downgrade(uint64_t extent_tag)
     assert(itr != bucket.entries.end());
     assert(itr->second.refcount == -1);
     itr->second.refcount = 1;
+    if (itr->second.waiters > 0)
+    {
+        pthread_cond_broadcast(&itr->second.cond);
+    }
     pthread_mutex_unlock(&bucket.lock);
 }
 
@@ -190,16 +295,28 @@ void extent_unlock(uint64_t extent_tag, bool wrlock, bool mark_clean)
         if (wrlock)
         {
             assert(itr->second.refcount == -1);
-            if (mark_clean)
+            if (mark_clean && itr->second.dirty)
             {
                 itr->second.dirty = false;
+                extent_dirty_bytes -= EXTENT_SIZE;
+                if (extent_dirty_waiters > 0)
+                {
+                    pthread_mutex_lock(&extent_dirty_lock);
+                    pthread_cond_broadcast(&extent_dirty_cond);
+                    pthread_mutex_unlock(&extent_dirty_lock);
+                }
             }
             itr->second.refcount++;
         }
         else
         {
+            assert(itr->second.refcount > 0);
             itr->second.refcount--;
         }
+        if (itr->second.waiters > 0 && itr->second.refcount == 0)
+        {
+            pthread_cond_broadcast(&itr->second.cond);
+        }
     }
     else // No existing entry
     {
@@ -220,9 +337,14 @@ bool extent_dirty(uint64_t extent_tag)
 
     auto index = extent_bucket_hash(extent_tag) % extent_buckets->size();
     auto &bucket = extent_buckets->operator[](index);
+    bool retval;
+
+    pthread_mutex_lock(&bucket.lock);
     auto itr = bucket.entries.find(extent_tag);
+    retval = ((itr != bucket.entries.end()) && (itr->second.dirty));
+    pthread_mutex_unlock(&bucket.lock);
 
-    return ((itr != bucket.entries.end()) && (itr->second.dirty));
+    return retval;
 }
 
 /**
@@ -237,45 +359,109 @@ bool extent_clean(uint64_t extent_tag)
 }
 
 /**
- * Return the tag of the first dirty, unreferenced extent through the
- * pointer.
+ * Find the dirty, unreferenced extents that are due to be written
+ * back.  An extent is due once it has not been written to for a
+ * while, or once it has been dirty for long enough regardless.
  *
- * @param extent_tag The return pointer
- * @return A boolean indicating whether an extent was found
+ * @param extent_tags The return pointer for the tags of the extents
+ * @param idle_ns How long an extent must have gone without being written to
+ * @param expire_ns How long an extent may stay dirty while it is being written to
  */
-bool extent_first_dirty_unreferenced(uint64_t *extent_tag)
+void extent_due(std::vector<uint64_t> *extent_tags, uint64_t idle_ns, uint64_t expire_ns)
 {
-    for (size_t i = 0; i < EXTENT_BUCKETS; ++i)
-    {
-        auto j = (i + moop) % EXTENT_BUCKETS;
-        auto &bucket = extent_buckets->operator[](j);
+    uint64_t now = extent_now_ns();
 
+    extent_tags->clear();
+    for (auto &bucket : *extent_buckets)
+    {
         pthread_mutex_lock(&bucket.lock);
-        for (auto itr = bucket.entries.begin(); itr != bucket.entries.end(); ++itr)
+        for (auto itr = bucket.entries.begin(); itr != bucket.entries.end();)
         {
-            if (itr->second.dirty && itr->second.refcount == 0)
+            bool due = (now - itr->second.written_ns >= idle_ns || now - itr->second.dirtied_ns >= expire_ns);
+
+            if (itr->second.dirty && itr->second.refcount == 0 && due)
             {
-                uint64_t retval = itr->first;
-                pthread_mutex_unlock(&bucket.lock);
-                *extent_tag = retval;
-                moop = j;
-                return true;
+                extent_tags->push_back(itr->first);
+                ++itr;
             }
-            else if (!itr->second.dirty && itr->second.refcount == 0)
+            else if (!itr->second.dirty && itr->second.refcount == 0 && itr->second.waiters == 0)
             {
-                // From
-                // http://www.cplusplus.com/reference/map/map/erase/:
-                // Iterators, pointers and references referring to
-                // elements removed by the function are invalidated.
-                // All other iterators, pointers and references keep
-                // their validity.
-                auto old_itr = itr;
-                itr++;
-                itr++;
-                bucket.entries.erase(old_itr);
+                // Clean, unreferenced entries carry no information
+                itr = bucket.entries.erase(itr);
+            }
+            else
+            {
+                ++itr;
             }
         }
         pthread_mutex_unlock(&bucket.lock);
     }
-    return false;
+}
+
+/**
+ * Find the extents that have been dirty since some time or earlier,
+ * whether or not they are in use.
+ *
+ * @param extent_tags The return pointer for the tags of the extents
+ * @param ns The time (from extent_now_ns)
+ */
+void extent_dirty_since(std::vector<uint64_t> *extent_tags, uint64_t ns)
+{
+    extent_tags->clear();
+    for (auto &bucket : *extent_buckets)
+    {
+        pthread_mutex_lock(&bucket.lock);
+        for (auto &entry : bucket.entries)
+        {
+            if (entry.second.dirty && entry.second.dirtied_ns <= ns)
+            {
+                extent_tags->push_back(entry.first);
+            }
+        }
+        pthread_mutex_unlock(&bucket.lock);
+    }
+}
+
+/**
+ * The amount of dirty data in the local cache.
+ *
+ * @return The number of bytes in dirty extents
+ */
+uint64_t extent_dirty_total()
+{
+    return extent_dirty_bytes;
+}
+
+/**
+ * Wait until there is less dirty data than some limit, or until a
+ * timeout passes, whichever comes first.
+ *
+ * @param limit The number of dirty bytes to get below
+ * @param timeout_ns How long to wait at most, in nanoseconds
+ * @return True if the amount of dirty data is below the limit
+ */
+bool extent_dirty_wait(uint64_t limit, uint64_t timeout_ns)
+{
+    struct timespec deadline;
+    bool retval;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    timeout_ns += deadline.tv_nsec;
+    deadline.tv_sec += timeout_ns / 1000000000;
+    deadline.tv_nsec = timeout_ns % 1000000000;
+
+    pthread_mutex_lock(&extent_dirty_lock);
+    extent_dirty_waiters++;
+    while (!(retval = (extent_dirty_bytes < limit)))
+    {
+        if (pthread_cond_timedwait(&extent_dirty_cond, &extent_dirty_lock, &deadline) != 0)
+        {
+            retval = (extent_dirty_bytes < limit);
+            break;
+        }
+    }
+    extent_dirty_waiters--;
+    pthread_mutex_unlock(&extent_dirty_lock);
+
+    return retval;
 }
@@ -26,15 +26,20 @@
 #define __EXTENT_H__
 
 #include <cstdint>
+#include <vector>
 
 void extent_init();
 void extent_deinit();
-bool extent_lock(uint64_t extent_tag, bool wrlock);
-void extent_spinlock(uint64_t extent_tag, bool wrlock);
+bool extent_lock(uint64_t extent_tag, bool wrlock, bool mark_dirty = true);
+void extent_lock_wait(uint64_t extent_tag, bool wrlock, bool mark_dirty = true);
 void extent_lock_downgrade(uint64_t extent_tag);
 void extent_unlock(uint64_t extent_tag, bool wrlock, bool mark_clean);
 bool extent_dirty(uint64_t extent_tag);
 bool extent_clean(uint64_t extent_tag);
-bool extent_first_dirty_unreferenced(uint64_t *extent_tag);
+uint64_t extent_now_ns();
+void extent_due(std::vector<uint64_t> *extent_tags, uint64_t idle_ns, uint64_t expire_ns);
+void extent_dirty_since(std::vector<uint64_t> *extent_tags, uint64_t ns);
+uint64_t extent_dirty_total();
+bool extent_dirty_wait(uint64_t limit, uint64_t timeout_ns);
 
 #endif
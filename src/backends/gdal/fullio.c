@@ -54,6 +54,32 @@ void fullread(int fd, void *buffer, int bytes)
     recvd += i;
   }
 }
+
+void fullpwrite(int fd, const void *buffer, size_t bytes, off_t offset)
+{
+  size_t sent = 0;
+
+  while (bytes - sent > 0)
+  {
+    ssize_t i = pwrite(fd, buffer + sent, bytes - sent, offset + sent);
+    if (i <= 0)
+      break;
+    sent += i;
+  }
+}
+
+void fullpread(int fd, void *buffer, size_t bytes, off_t offset)
+{
+  size_t recvd = 0;
+
+  while (bytes - recvd > 0)
+  {
+    ssize_t i = pread(fd, buffer + recvd, bytes - recvd, offset + recvd);
+    if (i <= 0)
+      break;
+    recvd += i;
+  }
+}
 #else
 void fullwrite(int fd, const void *buffer, int bytes)
 {
@@ -64,4 +90,14 @@ void fullread(int fd, void *buffer, int bytes)
 {
   read(fd, buffer, bytes);
 }
+
+void fullpwrite(int fd, const void *buffer, size_t bytes, off_t offset)
+{
+  pwrite(fd, buffer, bytes, offset);
+}
+
+void fullpread(int fd, void *buffer, size_t bytes, off_t offset)
+{
+  pread(fd, buffer, bytes, offset);
+}
 #endif
\ No newline at end of file
@@ -25,6 +25,9 @@
 #ifndef __FULLIO_H__
 #define __FULLIO_H__
 
+#include <stddef.h>
+#include <sys/types.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -32,6 +35,8 @@ extern "C"
 
     void fullwrite(int fd, const void *buffer, int bytes);
     void fullread(int fd, void *buffer, int bytes);
+    void fullpwrite(int fd, const void *buffer, size_t bytes, off_t offset);
+    void fullpread(int fd, void *buffer, size_t bytes, off_t offset);
 
 #ifdef __cplusplus
 }
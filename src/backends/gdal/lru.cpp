@@ -22,49 +22,45 @@
  * THE SOFTWARE.
  */
 
+#include <cassert>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
-#include <unistd.h>
-#include <pthread.h>
-
-#include <boost/compute/detail/lru_cache.hpp>
+#include <algorithm>
 
 #include "constants.h"
 #include "lru.h"
+#include "lru_policy.h"
+#include "metrics.h"
 
-typedef boost::compute::detail::lru_cache<uint64_t, bool> lru_cache_t;
-
-static lru_cache_t *lru_cache = nullptr;
-static pthread_mutex_t lru_cache_lock;
+static const lru_policy_t *lru_policies[] = {
+    &lru_policy_clock,
+    &lru_policy_exact,
+    &lru_policy_2q,
+    &lru_policy_s3fifo};
 
+static const lru_policy_t *lru_policy = nullptr;
 static void *(*lru_flusher)(void *) = nullptr;
+static uint64_t lru_capacity_extents = 0;
 
-/**
- * Specialization of the lru_cache_t::evict method.
- */
-template <>
-void lru_cache_t::evict()
-{
-    uint64_t tag;
+static metric_t &lru_hits = metric_register("lru_hits");
+static metric_t &lru_misses = metric_register("lru_misses");
 
-    // evict item from the end of most recently used list
-    typename list_type::iterator i = --m_list.end();
-    tag = *i;
-    m_map.erase(*i);
-    m_list.erase(i);
-
-    lru_flusher(reinterpret_cast<void *>(tag));
-}
+// Hits are counted per thread and published in batches so that the
+// common case does not contend on the shared counter
+static thread_local uint64_t lru_pending_hits = 0;
 
 /**
- * Initialize the cache.
+ * Initialize the cache.  The eviction policy is chosen by the
+ * S3BD_EVICTION_POLICY environment variable ("clock", "lru", "2q", or
+ * "s3fifo"); the default is "clock".
  *
- * @param size The maximuim number of cache entries.
+ * @param f The function to call with the tag of each evicted extent
  */
 void lru_init(void *(*f)(void *))
 {
     size_t local_cache_megabytes = LOCAL_CACHE_DEFAULT_MEGABYTES;
-    size_t local_cache_extents;
     const char *str;
 
     lru_flusher = f;
@@ -72,11 +68,22 @@ void lru_init(void *(*f)(void *))
     {
         sscanf(str, "%lu", &local_cache_megabytes);
     }
-    local_cache_extents = (local_cache_megabytes * (1 << 20)) / EXTENT_SIZE;
-    lru_cache_lock = PTHREAD_MUTEX_INITIALIZER;
-    if (lru_cache == nullptr)
+    lru_capacity_extents = std::max((local_cache_megabytes * (1 << 20)) / EXTENT_SIZE, static_cast<uint64_t>(1));
+
+    if (lru_policy == nullptr)
     {
-        lru_cache = new lru_cache_t{local_cache_extents};
+        lru_policy = lru_policies[0];
+        if ((str = getenv(S3BD_EVICTION_POLICY)) != nullptr)
+        {
+            for (auto policy : lru_policies)
+            {
+                if (strcmp(str, policy->name) == 0)
+                {
+                    lru_policy = policy;
+                }
+            }
+        }
+        lru_policy->init(lru_capacity_extents);
     }
 }
 
@@ -85,23 +92,53 @@ void lru_init(void *(*f)(void *))
  */
 void lru_deinit()
 {
-    if (lru_cache != nullptr)
+    if (lru_policy != nullptr)
     {
-        delete lru_cache;
-        lru_cache = nullptr;
+        lru_policy->deinit();
+        lru_policy = nullptr;
     }
 }
 
 /**
- * Report a page as being in use.
+ * The size of the cache.
+ *
+ * @return The number of extents that the cache holds
+ */
+uint64_t lru_capacity()
+{
+    return lru_capacity_extents;
+}
+
+/**
+ * Report an extent as being in use.  If that causes another extent to
+ * be evicted, the flusher is called for it.
  *
- * @param page_tag The page to report
+ * @param extent_tag The extent to report
  */
 void lru_report_extent(uint64_t extent_tag)
 {
     assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
 
-    pthread_mutex_lock(&lru_cache_lock);
-    lru_cache->insert(extent_tag, true);
-    pthread_mutex_unlock(&lru_cache_lock);
+    uint64_t victim = LRU_EMPTY;
+
+    if (lru_policy->report(extent_tag, &victim))
+    {
+        if (++lru_pending_hits >= LRU_HIT_BATCH)
+        {
+            lru_hits += lru_pending_hits;
+            lru_pending_hits = 0;
+        }
+    }
+    else
+    {
+        lru_hits += lru_pending_hits;
+        lru_pending_hits = 0;
+        lru_misses++;
+    }
+
+    // The flusher is called without any locks held
+    if (victim != LRU_EMPTY)
+    {
+        lru_flusher(reinterpret_cast<void *>(victim));
+    }
 }
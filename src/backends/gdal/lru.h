@@ -30,6 +30,7 @@
 
 void lru_init(void *(*f)(void *));
 void lru_deinit();
+uint64_t lru_capacity();
 void lru_report_extent(uint64_t extent_tag);
 
 #endif
@@ -0,0 +1,322 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cassert>
+
+#include <pthread.h>
+
+#include <atomic>
+
+#include "constants.h"
+#include "lru_policy.h"
+
+typedef struct
+{
+    std::atomic<uint64_t> tag;
+    std::atomic<uint8_t> referenced;
+} clock_slot_t;
+
+// Each shard is a CLOCK over an open-addressed table that is kept at
+// most half full.  Marking an extent that is already in the table
+// does not take the lock; inserting and evicting do.
+typedef struct
+{
+    pthread_mutex_t lock;
+    clock_slot_t *slots;
+    uint64_t mask;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t hand;
+    std::atomic<uint64_t> epoch; // Bumped whenever reference bits are cleared
+} clock_shard_t;
+
+static clock_shard_t *clock_shards = nullptr;
+static uint64_t clock_shard_count = 0;
+static uint64_t clock_generation = 0;
+
+// The last extent that this thread marked, and the shard epoch at the
+// time.  If the epoch has not moved, the reference bit is still set.
+static thread_local uint64_t clock_recent_tag = LRU_EMPTY;
+static thread_local uint64_t clock_recent_epoch = 0;
+static thread_local uint64_t clock_recent_generation = 0;
+
+/**
+ * Hash an extent tag.  The high bits select the shard and the middle
+ * bits select the home slot within it.
+ *
+ * @param extent_tag The extent tag
+ * @return The hash
+ */
+static inline uint64_t clock_hash(uint64_t extent_tag)
+{
+    return (extent_tag >> EXTENT_SHIFT) * 0x9E3779B97F4A7C15;
+}
+
+static inline clock_shard_t &clock_shard(uint64_t hash)
+{
+    return clock_shards[(hash >> 56) & (clock_shard_count - 1)];
+}
+
+static inline uint64_t clock_home(const clock_shard_t &shard, uint64_t hash)
+{
+    return (hash >> 8) & shard.mask;
+}
+
+/**
+ * Set the reference bit of an extent if it is in the shard.  This
+ * does not need the shard lock; an entry that is being moved by a
+ * concurrent removal may be missed, in which case the caller falls
+ * back to the locked path.
+ *
+ * @param shard The shard
+ * @param hash The hash of the extent tag
+ * @param extent_tag The extent tag
+ * @return True if the extent was found
+ */
+static bool clock_mark(clock_shard_t &shard, uint64_t hash, uint64_t extent_tag)
+{
+    uint64_t i = clock_home(shard, hash);
+
+    for (uint64_t probes = 0; probes <= shard.mask; ++probes, i = (i + 1) & shard.mask)
+    {
+        uint64_t tag = shard.slots[i].tag.load(std::memory_order_acquire);
+        if (tag == extent_tag)
+        {
+            // Avoid dirtying the cache line if the bit is already set
+            if (!shard.slots[i].referenced.load(std::memory_order_relaxed))
+            {
+                shard.slots[i].referenced.store(1, std::memory_order_relaxed);
+            }
+            return true;
+        }
+        else if (tag == LRU_EMPTY)
+        {
+            return false;
+        }
+    }
+    return false;
+}
+
+/**
+ * Remove the entry in a slot, shifting later entries of the same
+ * probe sequence back so that no tombstone is needed.  The shard lock
+ * must be held.
+ *
+ * @param shard The shard
+ * @param i The index of the slot
+ */
+static void clock_remove(clock_shard_t &shard, uint64_t i)
+{
+    for (uint64_t j = (i + 1) & shard.mask;; j = (j + 1) & shard.mask)
+    {
+        uint64_t tag = shard.slots[j].tag.load(std::memory_order_relaxed);
+        if (tag == LRU_EMPTY)
+        {
+            break;
+        }
+
+        // The entry can move back if the vacated slot lies between its
+        // home and where it is now
+        uint64_t home = clock_home(shard, clock_hash(tag));
+        if (((j - home) & shard.mask) >= ((j - i) & shard.mask))
+        {
+            shard.slots[i].referenced.store(shard.slots[j].referenced.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            shard.slots[i].tag.store(tag, std::memory_order_release);
+            i = j;
+        }
+    }
+    shard.slots[i].tag.store(LRU_EMPTY, std::memory_order_release);
+    shard.count--;
+}
+
+/**
+ * Advance the clock hand until an unreferenced extent is found, then
+ * remove it.  The shard lock must be held and the shard must not be
+ * empty.
+ *
+ * @param shard The shard
+ * @return The tag of the evicted extent
+ */
+static uint64_t clock_evict(clock_shard_t &shard)
+{
+    // Bump the epoch before any bits are cleared so that no thread
+    // keeps trusting a bit that is about to go away
+    shard.epoch.fetch_add(1, std::memory_order_acq_rel);
+
+    for (;; shard.hand = (shard.hand + 1) & shard.mask)
+    {
+        auto &slot = shard.slots[shard.hand];
+        uint64_t tag = slot.tag.load(std::memory_order_relaxed);
+
+        if (tag == LRU_EMPTY)
+        {
+            continue;
+        }
+        else if (slot.referenced.load(std::memory_order_relaxed))
+        {
+            slot.referenced.store(0, std::memory_order_relaxed);
+        }
+        else
+        {
+            clock_remove(shard, shard.hand);
+            return tag;
+        }
+    }
+}
+
+/**
+ * Insert an extent into a shard, evicting another if the shard is
+ * full.  The shard lock must not be held.
+ *
+ * @param shard The shard
+ * @param hash The hash of the extent tag
+ * @param extent_tag The extent tag
+ * @return The tag of the evicted extent, or LRU_EMPTY if there was none
+ */
+static uint64_t clock_insert(clock_shard_t &shard, uint64_t hash, uint64_t extent_tag)
+{
+    uint64_t victim = LRU_EMPTY;
+
+    pthread_mutex_lock(&shard.lock);
+
+    // Another thread may have inserted it in the meantime
+    if (clock_mark(shard, hash, extent_tag))
+    {
+        pthread_mutex_unlock(&shard.lock);
+        return LRU_EMPTY;
+    }
+
+    if (shard.count >= shard.capacity)
+    {
+        victim = clock_evict(shard);
+    }
+
+    uint64_t i = clock_home(shard, hash);
+    while (shard.slots[i].tag.load(std::memory_order_relaxed) != LRU_EMPTY)
+    {
+        i = (i + 1) & shard.mask;
+    }
+    shard.slots[i].referenced.store(1, std::memory_order_relaxed);
+    shard.slots[i].tag.store(extent_tag, std::memory_order_release);
+    shard.count++;
+
+    pthread_mutex_unlock(&shard.lock);
+
+    return victim;
+}
+
+/**
+ * Initialize the policy.
+ *
+ * @param capacity The number of extents that the cache can hold
+ */
+static void clock_init(uint64_t capacity)
+{
+    if (clock_shards == nullptr)
+    {
+        // Use fewer shards for a small cache so that every shard has room
+        clock_shard_count = LRU_SHARDS;
+        while (clock_shard_count > capacity)
+        {
+            clock_shard_count >>= 1;
+        }
+        clock_generation++;
+
+        clock_shards = new clock_shard_t[clock_shard_count];
+        for (uint64_t i = 0; i < clock_shard_count; ++i)
+        {
+            auto &shard = clock_shards[i];
+            uint64_t slots = 1;
+
+            shard.lock = PTHREAD_MUTEX_INITIALIZER;
+            shard.capacity = (capacity / clock_shard_count) + (i < (capacity % clock_shard_count) ? 1 : 0);
+            while (slots < 2 * shard.capacity)
+            {
+                slots <<= 1;
+            }
+            shard.slots = new clock_slot_t[slots];
+            for (uint64_t j = 0; j < slots; ++j)
+            {
+                shard.slots[j].tag.store(LRU_EMPTY, std::memory_order_relaxed);
+                shard.slots[j].referenced.store(0, std::memory_order_relaxed);
+            }
+            shard.mask = slots - 1;
+            shard.count = 0;
+            shard.hand = 0;
+            shard.epoch.store(0, std::memory_order_release);
+        }
+    }
+}
+
+/**
+ * Deinitialize the policy.
+ */
+static void clock_deinit()
+{
+    if (clock_shards != nullptr)
+    {
+        for (uint64_t i = 0; i < clock_shard_count; ++i)
+        {
+            delete[] clock_shards[i].slots;
+        }
+        delete[] clock_shards;
+        clock_shards = nullptr;
+    }
+}
+
+/**
+ * Report an extent as being in use.  In the common case, where the
+ * extent is already in the cache, this is at most one atomic store.
+ *
+ * @param extent_tag The extent to report
+ * @param victim The return pointer for the evicted extent, if any
+ * @return A boolean indicating whether the extent was already cached
+ */
+static bool clock_report(uint64_t extent_tag, uint64_t *victim)
+{
+    uint64_t hash = clock_hash(extent_tag);
+    auto &shard = clock_shard(hash);
+    uint64_t epoch = shard.epoch.load(std::memory_order_acquire);
+    bool hit = true;
+
+    // This thread marked the extent, and no bits have been cleared since
+    if (extent_tag == clock_recent_tag && epoch == clock_recent_epoch && clock_generation == clock_recent_generation)
+    {
+        return true;
+    }
+
+    if (!clock_mark(shard, hash, extent_tag))
+    {
+        *victim = clock_insert(shard, hash, extent_tag);
+        hit = false;
+    }
+
+    clock_recent_tag = extent_tag;
+    clock_recent_epoch = epoch;
+    clock_recent_generation = clock_generation;
+
+    return hit;
+}
+
+const lru_policy_t lru_policy_clock = {"clock", clock_init, clock_deinit, clock_report};
@@ -0,0 +1,377 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+
+#include "constants.h"
+#include "lru_policy.h"
+
+// These policies keep their state in lists and a map under a single
+// lock.  They are meant for workloads where a scan would otherwise
+// push the working set out of the cache.
+
+typedef std::list<uint64_t> policy_list_t;
+
+enum
+{
+    QUEUE_EXACT,
+    QUEUE_A1IN,
+    QUEUE_A1OUT,
+    QUEUE_AM,
+    QUEUE_SMALL,
+    QUEUE_MAIN,
+    QUEUE_GHOST
+};
+
+typedef struct
+{
+    uint8_t queue;
+    uint8_t frequency;
+    policy_list_t::iterator position;
+} policy_entry_t;
+
+typedef std::unordered_map<uint64_t, policy_entry_t> policy_index_t;
+
+static pthread_mutex_t policy_lock = PTHREAD_MUTEX_INITIALIZER;
+static policy_index_t *policy_index = nullptr;
+static uint64_t policy_capacity = 0;
+
+/**
+ * Move an entry to the front of a list.
+ *
+ * @param entry The entry
+ * @param from The list that the entry is in
+ * @param to The list to move it to
+ * @param queue The queue that the destination list represents
+ */
+static void policy_move(policy_entry_t &entry, policy_list_t &from, policy_list_t &to, uint8_t queue)
+{
+    to.splice(to.begin(), from, entry.position);
+    entry.queue = queue;
+}
+
+/**
+ * Append a new entry to the front of a list.
+ *
+ * @param extent_tag The extent
+ * @param to The list
+ * @param queue The queue that the list represents
+ */
+static void policy_push(uint64_t extent_tag, policy_list_t &to, uint8_t queue)
+{
+    to.push_front(extent_tag);
+    policy_index->operator[](extent_tag) = policy_entry_t{queue, 0, to.begin()};
+}
+
+/**
+ * Remove the entry at the back of a list entirely.
+ *
+ * @param from The list
+ * @return The tag of the removed entry
+ */
+static uint64_t policy_pop(policy_list_t &from)
+{
+    uint64_t extent_tag = from.back();
+    from.pop_back();
+    policy_index->erase(extent_tag);
+    return extent_tag;
+}
+
+static void policy_index_init(uint64_t capacity)
+{
+    policy_capacity = capacity;
+    if (policy_index == nullptr)
+    {
+        policy_index = new policy_index_t{};
+        policy_index->reserve(2 * capacity);
+    }
+}
+
+static void policy_index_deinit()
+{
+    if (policy_index != nullptr)
+    {
+        delete policy_index;
+        policy_index = nullptr;
+    }
+}
+
+// ------------------------------------------------------------------------
+// Exact LRU
+// ------------------------------------------------------------------------
+
+static policy_list_t *exact_list = nullptr;
+
+static void exact_init(uint64_t capacity)
+{
+    policy_index_init(capacity);
+    exact_list = new policy_list_t{};
+}
+
+static void exact_deinit()
+{
+    delete exact_list;
+    exact_list = nullptr;
+    policy_index_deinit();
+}
+
+/**
+ * Move an extent to the front of the recency list, evicting the least
+ * recently used extent if a new one does not fit.
+ */
+static bool exact_report(uint64_t extent_tag, uint64_t *victim)
+{
+    bool hit = true;
+
+    pthread_mutex_lock(&policy_lock);
+    auto itr = policy_index->find(extent_tag);
+    if (itr != policy_index->end())
+    {
+        policy_move(itr->second, *exact_list, *exact_list, QUEUE_EXACT);
+    }
+    else
+    {
+        if (exact_list->size() >= policy_capacity)
+        {
+            *victim = policy_pop(*exact_list);
+        }
+        policy_push(extent_tag, *exact_list, QUEUE_EXACT);
+        hit = false;
+    }
+    pthread_mutex_unlock(&policy_lock);
+
+    return hit;
+}
+
+const lru_policy_t lru_policy_exact = {"lru", exact_init, exact_deinit, exact_report};
+
+// ------------------------------------------------------------------------
+// 2Q (Johnson and Shasha): new extents enter a FIFO (A1in), and only
+// extents that come back after falling out of it (A1out, which
+// remembers tags only) are promoted to the LRU main queue (Am).
+// ------------------------------------------------------------------------
+
+static policy_list_t *twoq_a1in = nullptr;
+static policy_list_t *twoq_a1out = nullptr;
+static policy_list_t *twoq_am = nullptr;
+static uint64_t twoq_kin = 0;
+static uint64_t twoq_kout = 0;
+
+static void twoq_init(uint64_t capacity)
+{
+    policy_index_init(capacity);
+    twoq_a1in = new policy_list_t{};
+    twoq_a1out = new policy_list_t{};
+    twoq_am = new policy_list_t{};
+    twoq_kin = std::max(capacity / 4, static_cast<uint64_t>(1));
+    twoq_kout = std::max(capacity / 2, static_cast<uint64_t>(1));
+}
+
+static void twoq_deinit()
+{
+    delete twoq_a1in;
+    delete twoq_a1out;
+    delete twoq_am;
+    twoq_a1in = twoq_a1out = twoq_am = nullptr;
+    policy_index_deinit();
+}
+
+/**
+ * Make room for one more resident extent if the cache is full.
+ *
+ * @param victim The return pointer for the evicted extent
+ */
+static void twoq_reclaim(uint64_t *victim)
+{
+    if (twoq_a1in->size() + twoq_am->size() < policy_capacity)
+    {
+        return;
+    }
+
+    if (twoq_a1in->size() > twoq_kin || twoq_am->empty())
+    {
+        // The extent is no longer resident, but its tag is remembered
+        *victim = twoq_a1in->back();
+        policy_move(policy_index->at(*victim), *twoq_a1in, *twoq_a1out, QUEUE_A1OUT);
+        if (twoq_a1out->size() > twoq_kout)
+        {
+            policy_pop(*twoq_a1out);
+        }
+    }
+    else
+    {
+        *victim = policy_pop(*twoq_am);
+    }
+}
+
+static bool twoq_report(uint64_t extent_tag, uint64_t *victim)
+{
+    bool hit = true;
+
+    pthread_mutex_lock(&policy_lock);
+    auto itr = policy_index->find(extent_tag);
+    if (itr == policy_index->end())
+    {
+        twoq_reclaim(victim);
+        policy_push(extent_tag, *twoq_a1in, QUEUE_A1IN);
+        hit = false;
+    }
+    else if (itr->second.queue == QUEUE_AM)
+    {
+        policy_move(itr->second, *twoq_am, *twoq_am, QUEUE_AM);
+    }
+    else if (itr->second.queue == QUEUE_A1OUT)
+    {
+        // Seen before, but no longer resident: promote it
+        twoq_a1out->erase(itr->second.position);
+        policy_index->erase(itr);
+        twoq_reclaim(victim);
+        policy_push(extent_tag, *twoq_am, QUEUE_AM);
+        hit = false;
+    }
+    pthread_mutex_unlock(&policy_lock);
+
+    return hit;
+}
+
+const lru_policy_t lru_policy_2q = {"2q", twoq_init, twoq_deinit, twoq_report};
+
+// ------------------------------------------------------------------------
+// S3-FIFO (Yang et al.): new extents enter a small FIFO, and only
+// those touched again while there move to the main FIFO.  Extents
+// evicted from the small FIFO leave a tag in a ghost FIFO so that
+// they go straight to the main FIFO if they come back.  The main FIFO
+// gives each extent another lap per access, up to three.
+// ------------------------------------------------------------------------
+
+constexpr uint8_t S3FIFO_MAX_FREQUENCY = 3;
+
+static policy_list_t *s3fifo_small = nullptr;
+static policy_list_t *s3fifo_main = nullptr;
+static policy_list_t *s3fifo_ghost = nullptr;
+static uint64_t s3fifo_small_capacity = 0;
+static uint64_t s3fifo_ghost_capacity = 0;
+
+static void s3fifo_init(uint64_t capacity)
+{
+    policy_index_init(capacity);
+    s3fifo_small = new policy_list_t{};
+    s3fifo_main = new policy_list_t{};
+    s3fifo_ghost = new policy_list_t{};
+    s3fifo_small_capacity = std::max(capacity / 10, static_cast<uint64_t>(1));
+    s3fifo_ghost_capacity = std::max(capacity - s3fifo_small_capacity, static_cast<uint64_t>(1));
+}
+
+static void s3fifo_deinit()
+{
+    delete s3fifo_small;
+    delete s3fifo_main;
+    delete s3fifo_ghost;
+    s3fifo_small = s3fifo_main = s3fifo_ghost = nullptr;
+    policy_index_deinit();
+}
+
+/**
+ * Make room for one more resident extent if the cache is full.
+ *
+ * @param victim The return pointer for the evicted extent
+ */
+static void s3fifo_reclaim(uint64_t *victim)
+{
+    if (s3fifo_small->size() + s3fifo_main->size() < policy_capacity)
+    {
+        return;
+    }
+
+    while (true)
+    {
+        if (s3fifo_small->size() >= s3fifo_small_capacity || s3fifo_main->empty())
+        {
+            auto &entry = policy_index->at(s3fifo_small->back());
+            if (entry.frequency > 0)
+            {
+                entry.frequency = 0;
+                policy_move(entry, *s3fifo_small, *s3fifo_main, QUEUE_MAIN);
+                continue;
+            }
+
+            *victim = s3fifo_small->back();
+            policy_move(entry, *s3fifo_small, *s3fifo_ghost, QUEUE_GHOST);
+            if (s3fifo_ghost->size() > s3fifo_ghost_capacity)
+            {
+                policy_pop(*s3fifo_ghost);
+            }
+            return;
+        }
+        else
+        {
+            auto &entry = policy_index->at(s3fifo_main->back());
+            if (entry.frequency > 0)
+            {
+                entry.frequency--;
+                policy_move(entry, *s3fifo_main, *s3fifo_main, QUEUE_MAIN);
+                continue;
+            }
+
+            *victim = policy_pop(*s3fifo_main);
+            return;
+        }
+    }
+}
+
+static bool s3fifo_report(uint64_t extent_tag, uint64_t *victim)
+{
+    bool hit = true;
+
+    pthread_mutex_lock(&policy_lock);
+    auto itr = policy_index->find(extent_tag);
+    if (itr == policy_index->end())
+    {
+        s3fifo_reclaim(victim);
+        policy_push(extent_tag, *s3fifo_small, QUEUE_SMALL);
+        hit = false;
+    }
+    else if (itr->second.queue == QUEUE_GHOST)
+    {
+        s3fifo_ghost->erase(itr->second.position);
+        policy_index->erase(itr);
+        s3fifo_reclaim(victim);
+        policy_push(extent_tag, *s3fifo_main, QUEUE_MAIN);
+        hit = false;
+    }
+    else
+    {
+        auto &entry = itr->second;
+        entry.frequency = std::min(static_cast<uint8_t>(entry.frequency + 1), S3FIFO_MAX_FREQUENCY);
+    }
+    pthread_mutex_unlock(&policy_lock);
+
+    return hit;
+}
+
+const lru_policy_t lru_policy_s3fifo = {"s3fifo", s3fifo_init, s3fifo_deinit, s3fifo_report};
@@ -0,0 +1,52 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __LRU_POLICY_H__
+#define __LRU_POLICY_H__
+
+#include <cstdint>
+
+// Extent tags are extent-aligned, so this can never be one
+constexpr uint64_t LRU_EMPTY = UINT64_MAX;
+
+/**
+ * An eviction policy.  The report function records an access to an
+ * extent, inserting it if it is not already cached, and returns the
+ * tag of at most one extent that had to be evicted to make room.  It
+ * may be called from any number of threads at once.
+ */
+typedef struct
+{
+    const char *name;
+    void (*init)(uint64_t capacity);
+    void (*deinit)();
+    bool (*report)(uint64_t extent_tag, uint64_t *victim);
+} lru_policy_t;
+
+extern const lru_policy_t lru_policy_clock;
+extern const lru_policy_t lru_policy_exact;
+extern const lru_policy_t lru_policy_2q;
+extern const lru_policy_t lru_policy_s3fifo;
+
+#endif
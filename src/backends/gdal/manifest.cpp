@@ -0,0 +1,537 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include <pthread.h>
+
+#include <gdal.h>
+#include <cpl_vsi.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "manifest.h"
+
+// The manifest records which extents exist in remote storage, one bit
+// per extent.  It is stored in chunks, each covering
+// MANIFEST_CHUNK_EXTENTS extents, so that recording a new extent only
+// rewrites a small object.  A bit is set before the extent is first
+// stored, so the manifest may claim an extent that does not exist (if
+// the store then failed) but never the other way around.
+//
+// Each chunk also has a second bit per extent, set when the extent is
+// stored as all zeros, so that such extents are never read.  It is set
+// after a zero extent is stored and cleared before anything else is,
+// so it may miss a zero extent but never claims one that is not.
+//
+// An index object lists the chunks, so that a mount can read them
+// without listing the storage directory.  A new chunk is stored before
+// it is added to the index; until then, it claims only the extent that
+// is about to be stored.
+//
+// Objects are stored without holding the manifest lock.  Each one
+// counts its changes, and is stored by one thread at a time from a
+// snapshot; a thread that needs a change stored waits until a snapshot
+// that includes it has been.
+
+typedef struct
+{
+    std::vector<uint8_t> bytes;
+    uint64_t version; // Advanced by every change to the bytes
+    uint64_t stored;  // The last version stored
+    bool busy;        // True while a snapshot is being stored
+} manifest_object_t;
+
+typedef struct
+{
+    manifest_object_t object;
+    uint64_t indexed; // The version of the index that lists the chunk
+} manifest_chunk_t;
+
+typedef std::map<uint64_t, manifest_chunk_t> manifest_chunks_t;
+
+constexpr size_t MANIFEST_BITS_BYTES = MANIFEST_CHUNK_EXTENTS / 8;
+constexpr size_t MANIFEST_CHUNK_BYTES = 2 * MANIFEST_BITS_BYTES; // Existence, then zeros
+
+static pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t manifest_cond = PTHREAD_COND_INITIALIZER;
+static manifest_chunks_t *manifest_chunks = nullptr;
+static manifest_object_t *manifest_index = nullptr;
+static const char *manifest_dir = nullptr;
+static bool manifest_valid = false;
+
+/**
+ * Write an object of the manifest to remote storage.
+ *
+ * @param filename The name of the object
+ * @param bytes The contents of the object
+ * @return A boolean indicating success or failure
+ */
+static bool manifest_write(const char *filename, const std::vector<uint8_t> &bytes)
+{
+    VSILFILE *handle = NULL;
+
+    if ((handle = VSIFOpenL(filename, "w")) == NULL)
+    {
+        return false;
+    }
+    if (!bytes.empty() && VSIFWriteL(bytes.data(), bytes.size(), 1, handle) != 1)
+    {
+        VSIFCloseL(handle);
+        return false;
+    }
+    VSIFFlushL(handle);
+    return (VSIFCloseL(handle) == 0);
+}
+
+/**
+ * Read an object of the manifest from remote storage.
+ *
+ * @param filename The name of the object
+ * @param bytes The return pointer for the contents of the object
+ * @return A boolean indicating success or failure
+ */
+static bool manifest_read(const char *filename, std::vector<uint8_t> *bytes)
+{
+    VSILFILE *handle = NULL;
+    bool ok;
+
+    if ((handle = VSIFOpenL(filename, "r")) == NULL)
+    {
+        return false;
+    }
+    ok = (VSIFSeekL(handle, 0, SEEK_END) == 0);
+    bytes->resize(ok ? VSIFTellL(handle) : 0);
+    ok = ok && (VSIFSeekL(handle, 0, SEEK_SET) == 0);
+    ok = ok && (bytes->empty() || VSIFReadL(bytes->data(), bytes->size(), 1, handle) == 1);
+    VSIFCloseL(handle);
+    return ok;
+}
+
+/**
+ * Make sure that a version of an object of the manifest is stored,
+ * storing the latest snapshot if no other thread is already storing
+ * one.  The manifest lock must be held; it is released while storing.
+ *
+ * @param object The object
+ * @param filename The name of the object
+ * @param version The version that must be stored
+ * @return A boolean indicating success or failure
+ */
+static bool manifest_sync(manifest_object_t &object, const char *filename, uint64_t version)
+{
+    bool ok = true;
+
+    while (ok && object.stored < version)
+    {
+        if (object.busy)
+        {
+            pthread_cond_wait(&manifest_cond, &manifest_lock);
+            continue;
+        }
+
+        std::vector<uint8_t> snapshot = object.bytes;
+        uint64_t snapshot_version = object.version;
+
+        object.busy = true;
+        pthread_mutex_unlock(&manifest_lock);
+        ok = manifest_write(filename, snapshot);
+        pthread_mutex_lock(&manifest_lock);
+        object.busy = false;
+        if (ok)
+        {
+            object.stored = std::max(object.stored, snapshot_version);
+        }
+        pthread_cond_broadcast(&manifest_cond);
+    }
+
+    return ok;
+}
+
+/**
+ * Set or clear a bit for an extent in memory.  The manifest lock must
+ * be held.
+ *
+ * @param extent_tag The extent
+ * @param offset The offset of the bits within the chunk (0 for existence, MANIFEST_BITS_BYTES for zeros)
+ * @param value The value of the bit
+ * @param chunk_index The return pointer for the index of the chunk
+ * @return True if the bit changed
+ */
+static bool manifest_set(uint64_t extent_tag, size_t offset, bool value, uint64_t *chunk_index)
+{
+    uint64_t index = extent_tag >> EXTENT_SHIFT;
+    auto &chunk = manifest_chunks->operator[](index / MANIFEST_CHUNK_EXTENTS).object;
+    uint64_t bit = index % MANIFEST_CHUNK_EXTENTS;
+
+    *chunk_index = index / MANIFEST_CHUNK_EXTENTS;
+    if (chunk.bytes.empty())
+    {
+        chunk.bytes.resize(MANIFEST_CHUNK_BYTES, 0);
+    }
+
+    uint8_t &byte = chunk.bytes[offset + bit / 8];
+    if (static_cast<bool>(byte & (1 << (bit % 8))) == value)
+    {
+        return false;
+    }
+    byte ^= (1 << (bit % 8));
+    chunk.version++;
+    return true;
+}
+
+/**
+ * Get a bit for an extent.  The manifest lock must be held.
+ *
+ * @param extent_tag The extent
+ * @param offset The offset of the bits within the chunk
+ * @return The value of the bit, or false if the chunk does not exist
+ */
+static bool manifest_get(uint64_t extent_tag, size_t offset)
+{
+    uint64_t index = extent_tag >> EXTENT_SHIFT;
+    uint64_t bit = index % MANIFEST_CHUNK_EXTENTS;
+    auto itr = manifest_chunks->find(index / MANIFEST_CHUNK_EXTENTS);
+
+    return (itr != manifest_chunks->end() &&
+            !itr->second.object.bytes.empty() &&
+            (itr->second.object.bytes[offset + bit / 8] & (1 << (bit % 8))));
+}
+
+/**
+ * Add a chunk to the index in memory.  The manifest lock must be
+ * held.
+ *
+ * @param chunk_index The index of the chunk
+ */
+static void manifest_list(uint64_t chunk_index)
+{
+    char line[0x20];
+
+    sprintf(line, "%08lX\n", chunk_index);
+    manifest_index->bytes.insert(manifest_index->bytes.end(), line, line + strlen(line));
+    manifest_index->version++;
+    manifest_chunks->operator[](chunk_index).indexed = manifest_index->version;
+}
+
+/**
+ * Load the chunks that the index lists.
+ *
+ * @return A boolean indicating whether all of them were loaded
+ */
+static bool manifest_load()
+{
+    char filename[0x100];
+    std::string listing(manifest_index->bytes.begin(), manifest_index->bytes.end());
+    const char *line = listing.c_str();
+    uint64_t index;
+    int length;
+
+    manifest_index->version = 1;
+    while (sscanf(line, "%8lX\n%n", &index, &length) == 1)
+    {
+        auto &chunk = manifest_chunks->operator[](index);
+
+        sprintf(filename, MANIFEST_TEMPLATE, manifest_dir, index);
+        // Chunks from before the zero bits have none
+        if (!manifest_read(filename, &chunk.object.bytes) ||
+            (chunk.object.bytes.size() != MANIFEST_CHUNK_BYTES && chunk.object.bytes.size() != MANIFEST_BITS_BYTES))
+        {
+            return false;
+        }
+        chunk.object.bytes.resize(MANIFEST_CHUNK_BYTES, 0);
+        chunk.indexed = manifest_index->version;
+        line += length;
+    }
+
+    return true;
+}
+
+/**
+ * Build the manifest from a listing of the extents (and references)
+ * in the storage directory, and store it.
+ *
+ * @param names The listing
+ * @return A boolean indicating success or failure
+ */
+static bool manifest_build(char **names)
+{
+    char filename[0x100];
+    std::set<uint64_t> touched;
+
+    for (char **name = names; name != NULL && *name != NULL; ++name)
+    {
+        uint64_t extent_tag, index;
+        char suffix[0x10];
+
+        if (sscanf(*name, "%16lX.%15s", &extent_tag, suffix) == 2 &&
+            strlen(*name) == 16 + 1 + strlen(suffix) &&
+            (strcmp(suffix, "extent") == 0 || strcmp(suffix, "ref") == 0) &&
+            extent_tag == (extent_tag & (~EXTENT_MASK)))
+        {
+            manifest_set(extent_tag, 0, true, &index);
+            touched.insert(index);
+        }
+    }
+
+    // The chunks are stored before the index that lists them, and the
+    // index is stored even if it is empty, so that the manifest is
+    // known to exist
+    for (auto index : touched)
+    {
+        sprintf(filename, MANIFEST_TEMPLATE, manifest_dir, index);
+        if (!manifest_write(filename, manifest_chunks->operator[](index).object.bytes))
+        {
+            return false;
+        }
+        manifest_list(index);
+    }
+    sprintf(filename, MANIFEST_INDEX_TEMPLATE, manifest_dir);
+    return manifest_write(filename, manifest_index->bytes);
+}
+
+/**
+ * Load the manifest.  The index is read, and then the chunks it lists.
+ * If there is no index, the manifest is built from a listing of the
+ * storage directory and stored.  If the manifest cannot be read, or
+ * cannot be stored (or the S3BD_NO_MANIFEST environment variable is
+ * set), there is no manifest, and every extent is presumed to exist.
+ *
+ * @param blockdir The storage directory
+ */
+void manifest_init(const char *blockdir)
+{
+    char filename[0x100];
+    VSIStatBufL stat;
+    bool ok;
+
+    manifest_dir = blockdir;
+    manifest_valid = false;
+    if (manifest_chunks == nullptr)
+    {
+        manifest_chunks = new manifest_chunks_t{};
+        manifest_index = new manifest_object_t{};
+    }
+    if (getenv(S3BD_NO_MANIFEST) != nullptr)
+    {
+        return;
+    }
+
+    sprintf(filename, MANIFEST_INDEX_TEMPLATE, blockdir);
+    errno = 0;
+    if (VSIStatL(filename, &stat) == 0)
+    {
+        ok = (manifest_read(filename, &manifest_index->bytes) && manifest_load());
+    }
+    else if (errno != 0 && errno != ENOENT)
+    {
+        ok = false;
+    }
+    else
+    {
+        // Not every filesystem says why it could not find the index,
+        // so the listing must agree that there is none
+        char **names = VSIReadDir(blockdir);
+        const char *basename = strrchr(filename, '/') + 1;
+
+        ok = true;
+        for (char **name = names; name != NULL && *name != NULL && ok; ++name)
+        {
+            ok = (strcmp(*name, basename) != 0);
+        }
+        ok = ok && manifest_build(names);
+        CSLDestroy(names);
+    }
+
+    if (!ok)
+    {
+        manifest_chunks->clear();
+        *manifest_index = manifest_object_t{};
+        return;
+    }
+    for (auto &itr : *manifest_chunks)
+    {
+        itr.second.object.stored = itr.second.object.version;
+    }
+    manifest_index->stored = manifest_index->version;
+    manifest_valid = true;
+}
+
+/**
+ * Deinitialize the manifest.
+ */
+void manifest_deinit()
+{
+    if (manifest_chunks != nullptr)
+    {
+        delete manifest_chunks;
+        delete manifest_index;
+        manifest_chunks = nullptr;
+        manifest_index = nullptr;
+    }
+    manifest_valid = false;
+}
+
+/**
+ * Whether an extent is known not to exist in remote storage.
+ *
+ * @param extent_tag The extent
+ * @return True if it certainly does not exist
+ */
+bool manifest_absent(uint64_t extent_tag)
+{
+    assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
+
+    bool absent;
+
+    if (!manifest_valid)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&manifest_lock);
+    absent = !manifest_get(extent_tag, 0);
+    pthread_mutex_unlock(&manifest_lock);
+
+    return absent;
+}
+
+/**
+ * Whether an extent is known to be stored as all zeros.
+ *
+ * @param extent_tag The extent
+ * @return True if it certainly is
+ */
+bool manifest_zero(uint64_t extent_tag)
+{
+    assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
+
+    bool zero;
+
+    if (!manifest_valid)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&manifest_lock);
+    zero = manifest_get(extent_tag, MANIFEST_BITS_BYTES);
+    pthread_mutex_unlock(&manifest_lock);
+
+    return zero;
+}
+
+/**
+ * Store a chunk, and an index that lists it, if they have changes
+ * that are not yet stored.  The manifest lock must be held; it is
+ * released while storing.
+ *
+ * @param index The index of the chunk
+ * @return A boolean indicating success or failure
+ */
+static bool manifest_store(uint64_t index)
+{
+    auto &chunk = manifest_chunks->operator[](index);
+    char filename[0x100];
+    bool ok;
+
+    sprintf(filename, MANIFEST_TEMPLATE, manifest_dir, index);
+    ok = manifest_sync(chunk.object, filename, chunk.object.version);
+    if (ok && chunk.indexed == 0)
+    {
+        manifest_list(index);
+    }
+    if (ok)
+    {
+        sprintf(filename, MANIFEST_INDEX_TEMPLATE, manifest_dir);
+        ok = manifest_sync(*manifest_index, filename, chunk.indexed);
+    }
+
+    return ok;
+}
+
+/**
+ * Record that an extent is about to be stored.  This must succeed
+ * before the extent itself is stored.  If it fails, the bit stays set
+ * in memory, and is stored by the next attempt.
+ *
+ * @param extent_tag The extent
+ * @return A boolean indicating success or failure
+ */
+bool manifest_insert(uint64_t extent_tag)
+{
+    assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
+
+    uint64_t index;
+    bool ok;
+
+    if (!manifest_valid)
+    {
+        return true;
+    }
+
+    pthread_mutex_lock(&manifest_lock);
+    manifest_set(extent_tag, 0, true, &index);
+    ok = manifest_store(index);
+    pthread_mutex_unlock(&manifest_lock);
+
+    return ok;
+}
+
+/**
+ * Record whether an extent is stored as all zeros.  The bit must be
+ * cleared (successfully) before anything but zeros is stored, and
+ * only set after zeros have been.
+ *
+ * @param extent_tag The extent
+ * @param zero Whether the extent is all zeros
+ * @return A boolean indicating success or failure
+ */
+bool manifest_set_zero(uint64_t extent_tag, bool zero)
+{
+    assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
+
+    uint64_t index;
+    bool ok;
+
+    if (!manifest_valid)
+    {
+        return true;
+    }
+
+    pthread_mutex_lock(&manifest_lock);
+    manifest_set(extent_tag, MANIFEST_BITS_BYTES, zero, &index);
+    ok = manifest_store(index);
+    pthread_mutex_unlock(&manifest_lock);
+
+    return ok;
+}
@@ -0,0 +1,90 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cstring>
+
+#include <pthread.h>
+
+#include <map>
+#include <string>
+
+#include "metrics.h"
+
+typedef std::map<std::string, metric_t *> metric_map_t;
+
+static pthread_mutex_t metric_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The registry of counters.  It is constructed on first use so that
+ * counters can be registered from static initializers in any
+ * translation unit.
+ */
+static metric_map_t &metric_map()
+{
+    static metric_map_t *map = new metric_map_t{};
+    return *map;
+}
+
+/**
+ * Register (or look up) a named counter.  The returned reference
+ * remains valid for the life of the process.
+ *
+ * @param name The name of the counter
+ * @return A reference to the counter
+ */
+metric_t &metric_register(const char *name)
+{
+    pthread_mutex_lock(&metric_map_lock);
+    auto &map = metric_map();
+    auto itr = map.find(name);
+    if (itr == map.end())
+    {
+        itr = map.insert(std::make_pair(std::string{name}, new metric_t{0})).first;
+    }
+    pthread_mutex_unlock(&metric_map_lock);
+    return *(itr->second);
+}
+
+/**
+ * Read the current value of a named counter.
+ *
+ * @param name The name of the counter
+ * @param value The return pointer
+ * @return A boolean indicating whether the counter exists
+ */
+bool metric_value(const char *name, uint64_t *value)
+{
+    bool retval = false;
+
+    pthread_mutex_lock(&metric_map_lock);
+    auto &map = metric_map();
+    auto itr = map.find(name);
+    if (itr != map.end())
+    {
+        *value = itr->second->load();
+        retval = true;
+    }
+    pthread_mutex_unlock(&metric_map_lock);
+    return retval;
+}
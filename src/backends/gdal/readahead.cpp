@@ -0,0 +1,288 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "constants.h"
+#include "metrics.h"
+#include "readahead.h"
+
+typedef struct
+{
+    uint64_t next;    // The offset at which the stream is expected to continue
+    uint64_t horizon; // The last extent requested on behalf of the stream
+    uint32_t run;     // The number of consecutive sequential reads seen
+} readahead_stream_t;
+
+typedef std::deque<uint64_t> readahead_pending_t;
+typedef std::map<uint64_t, bool> readahead_requested_t; // tag -> demanded while in flight
+typedef std::set<uint64_t> readahead_prefetched_t;
+
+static readahead_stream_t readahead_streams[READAHEAD_STREAMS] = {};
+static size_t readahead_victim = 0;
+static readahead_pending_t *readahead_pending = nullptr;
+static readahead_requested_t *readahead_requested = nullptr;
+static readahead_prefetched_t *readahead_prefetched = nullptr;
+static std::vector<pthread_t> *readahead_threads = nullptr;
+static pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readahead_cond = PTHREAD_COND_INITIALIZER;
+static bool readahead_continue = false;
+static size_t readahead_window = 1;
+static size_t readahead_window_max = READAHEAD_DEFAULT_EXTENTS;
+
+static bool (*readahead_fetcher)(uint64_t) = nullptr;
+
+static metric_t &readahead_fetches = metric_register("readahead_fetches");
+static metric_t &readahead_hits = metric_register("readahead_hits");
+static metric_t &readahead_wasted = metric_register("readahead_wasted");
+static metric_t &readahead_skipped = metric_register("readahead_skipped");
+
+void *readahead_worker(void *arg);
+
+/**
+ * Initialize read-ahead.
+ *
+ * @param f A function that brings the given extent into the scratch
+ * file, returning true iff it actually had to be fetched
+ */
+void readahead_init(bool (*f)(uint64_t))
+{
+    const char *str;
+
+    readahead_fetcher = f;
+    readahead_window_max = READAHEAD_DEFAULT_EXTENTS;
+    if ((str = getenv(S3BD_READAHEAD_EXTENTS)) != nullptr)
+    {
+        sscanf(str, "%lu", &readahead_window_max);
+    }
+    readahead_window = std::min(static_cast<size_t>(1), readahead_window_max);
+    readahead_victim = 0;
+    for (size_t i = 0; i < READAHEAD_STREAMS; ++i)
+    {
+        readahead_streams[i] = readahead_stream_t{};
+    }
+
+    if (readahead_threads == nullptr)
+    {
+        readahead_pending = new readahead_pending_t{};
+        readahead_requested = new readahead_requested_t{};
+        readahead_prefetched = new readahead_prefetched_t{};
+        readahead_threads = new std::vector<pthread_t>{};
+        readahead_continue = true;
+        for (size_t i = 0; readahead_window_max > 0 && i < READAHEAD_WORKERS; ++i)
+        {
+            pthread_t thread;
+            pthread_create(&thread, NULL, readahead_worker, nullptr);
+            readahead_threads->push_back(thread);
+        }
+    }
+}
+
+/**
+ * Deinitialize read-ahead.
+ */
+void readahead_deinit()
+{
+    if (readahead_threads != nullptr)
+    {
+        pthread_mutex_lock(&readahead_lock);
+        readahead_continue = false;
+        pthread_cond_broadcast(&readahead_cond);
+        pthread_mutex_unlock(&readahead_lock);
+        for (auto thread : *readahead_threads)
+        {
+            pthread_join(thread, nullptr);
+        }
+        delete readahead_threads;
+        delete readahead_prefetched;
+        delete readahead_requested;
+        delete readahead_pending;
+        readahead_threads = nullptr;
+        readahead_prefetched = nullptr;
+        readahead_requested = nullptr;
+        readahead_pending = nullptr;
+    }
+}
+
+/**
+ * Report a read.  Reads that continue a previously-seen stream cause
+ * the following extents to be requested in the background.  This is
+ * called for every read, so it never waits: a read that finds another
+ * being reported is skipped.  A stream that loses a read that way is
+ * detected again a few reads later.
+ *
+ * @param offset The virtual block device offset of the read
+ * @param size The number of bytes read
+ */
+void readahead_report(uint64_t offset, size_t size)
+{
+    if (readahead_window_max == 0 || size == 0)
+    {
+        return;
+    }
+
+    uint64_t end = offset + size;
+    uint64_t first_extent_tag = offset & (~EXTENT_MASK);
+    uint64_t last_extent_tag = (end - 1) & (~EXTENT_MASK);
+    readahead_stream_t *stream = nullptr;
+
+    if (pthread_mutex_trylock(&readahead_lock) != 0)
+    {
+        readahead_skipped++;
+        return;
+    }
+
+    // Account for extents that were fetched ahead of this read
+    for (uint64_t extent_tag = first_extent_tag; extent_tag <= last_extent_tag; extent_tag += EXTENT_SIZE)
+    {
+        auto itr = readahead_requested->find(extent_tag);
+        if (itr != readahead_requested->end()) // Still in flight
+        {
+            itr->second = true;
+        }
+        else if (readahead_prefetched->erase(extent_tag) != 0)
+        {
+            readahead_hits++;
+            readahead_window = std::min(2 * readahead_window, readahead_window_max);
+        }
+    }
+
+    // Find the stream that this read continues, or start a new one
+    for (size_t i = 0; i < READAHEAD_STREAMS; ++i)
+    {
+        uint64_t next = readahead_streams[i].next;
+        if (readahead_streams[i].run > 0 && offset <= next + PAGE_SIZE && next <= offset + PAGE_SIZE)
+        {
+            stream = &readahead_streams[i];
+            break;
+        }
+    }
+    if (stream != nullptr)
+    {
+        stream->run++;
+        stream->next = end;
+    }
+    else
+    {
+        stream = &readahead_streams[readahead_victim];
+        readahead_victim = (readahead_victim + 1) % READAHEAD_STREAMS;
+        *stream = readahead_stream_t{end, last_extent_tag, 1};
+    }
+
+    // Request the extents in front of a sequential stream
+    if (stream->run >= READAHEAD_TRIGGER)
+    {
+        uint64_t target = last_extent_tag + (readahead_window * EXTENT_SIZE);
+        for (uint64_t extent_tag = std::max(stream->horizon, last_extent_tag) + EXTENT_SIZE;
+             extent_tag <= target;
+             extent_tag += EXTENT_SIZE)
+        {
+            if (readahead_requested->count(extent_tag) == 0 && readahead_prefetched->count(extent_tag) == 0)
+            {
+                readahead_requested->insert(std::make_pair(extent_tag, false));
+                readahead_pending->push_back(extent_tag);
+            }
+        }
+        stream->horizon = std::max(stream->horizon, target);
+        pthread_cond_signal(&readahead_cond);
+    }
+
+    pthread_mutex_unlock(&readahead_lock);
+}
+
+/**
+ * Report that an extent has been evicted from the scratch file.  An
+ * extent that was fetched ahead but never read counts against the
+ * read-ahead window.
+ *
+ * @param extent_tag The tag of the evicted extent
+ */
+void readahead_evicted(uint64_t extent_tag)
+{
+    if (readahead_window_max == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&readahead_lock);
+    if (readahead_prefetched->erase(extent_tag) != 0)
+    {
+        readahead_wasted++;
+        readahead_window = std::max(readahead_window / 2, static_cast<size_t>(1));
+    }
+    pthread_mutex_unlock(&readahead_lock);
+}
+
+/**
+ * Fetch requested extents in the background.
+ *
+ * @param arg Unused
+ * @return Always nullptr
+ */
+void *readahead_worker(void *arg)
+{
+    pthread_mutex_lock(&readahead_lock);
+    while (readahead_continue)
+    {
+        if (readahead_pending->empty())
+        {
+            pthread_cond_wait(&readahead_cond, &readahead_lock);
+            continue;
+        }
+
+        uint64_t extent_tag = readahead_pending->front();
+        readahead_pending->pop_front();
+        pthread_mutex_unlock(&readahead_lock);
+        bool fetched = readahead_fetcher(extent_tag);
+        pthread_mutex_lock(&readahead_lock);
+
+        auto itr = readahead_requested->find(extent_tag);
+        if (fetched)
+        {
+            readahead_fetches++;
+            if (itr->second) // Already read while in flight
+            {
+                readahead_hits++;
+                readahead_window = std::min(2 * readahead_window, readahead_window_max);
+            }
+            else
+            {
+                readahead_prefetched->insert(extent_tag);
+            }
+        }
+        readahead_requested->erase(itr);
+    }
+    pthread_mutex_unlock(&readahead_lock);
+    return nullptr;
+}
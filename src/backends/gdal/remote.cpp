@@ -0,0 +1,748 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+
+#include <pthread.h>
+
+#include <gdal.h>
+#include <cpl_vsi.h>
+
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "codec.h"
+#include "dedup.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "remote.h"
+#include "volume.h"
+
+typedef std::set<uint64_t> remote_tags_t;
+typedef std::map<uint64_t, std::string> remote_refs_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    remote_tags_t absent;
+    remote_tags_t encoded;
+    remote_tags_t zero;
+    remote_refs_t refs; // Content hashes, or empty strings for positional extents
+} remote_bucket_t;
+
+typedef std::vector<remote_bucket_t> remote_buckets_t;
+
+static std::hash<uint64_t> remote_bucket_hash = std::hash<uint64_t>{};
+static remote_buckets_t *remote_buckets = nullptr;
+static const char *blockdir = nullptr;
+
+// Content hashes known to be stored
+static pthread_mutex_t remote_stored_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::set<std::string> *remote_stored = nullptr;
+
+// The generation of the volume is advanced before the first extent is
+// stored by each mount, so that a mount can tell whether anything else
+// has changed the volume since it last saw it
+static pthread_mutex_t remote_generation_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t remote_generation_value = 0;
+static bool remote_generation_advanced = false;
+
+static metric_t &remote_bytes_fetched = metric_register("remote_bytes_fetched");
+static metric_t &remote_bytes_stored = metric_register("remote_bytes_stored");
+static metric_t &remote_zero_extents = metric_register("remote_zero_extents");
+static metric_t &remote_dedup_hits = metric_register("remote_dedup_hits");
+static metric_t &remote_reads = metric_register("remote_reads");
+
+/**
+ * Initialize remote storage.
+ *
+ * @param _blockdir A pointer to a string giving the path to the storage directory
+ */
+void remote_init(const char *_blockdir)
+{
+    char filename[0x100];
+    char generation[0x20] = {};
+    VSILFILE *handle = NULL;
+
+    blockdir = _blockdir;
+    sprintf(filename, GENERATION_TEMPLATE, blockdir);
+    remote_generation_value = 0;
+    remote_generation_advanced = false;
+    if ((handle = VSIFOpenL(filename, "r")) != NULL)
+    {
+        VSIFReadL(generation, 1, sizeof(generation) - 1, handle);
+        VSIFCloseL(handle);
+        sscanf(generation, "%lu", &remote_generation_value);
+    }
+    codec_init();
+    dedup_init(_blockdir);
+    manifest_init(_blockdir);
+    if (remote_stored == nullptr)
+    {
+        remote_stored = new std::set<std::string>{};
+    }
+    if (remote_buckets == nullptr)
+    {
+        remote_buckets = new remote_buckets_t{};
+        for (size_t i = 0; i < EXTENT_BUCKETS; ++i)
+        {
+            remote_buckets->push_back(remote_bucket_t{
+                PTHREAD_MUTEX_INITIALIZER,
+                remote_tags_t{},
+                remote_tags_t{},
+                remote_tags_t{},
+                remote_refs_t{}});
+        }
+    }
+}
+
+/**
+ * Deinitialize remote storage.
+ */
+void remote_deinit()
+{
+    if (remote_buckets != nullptr)
+    {
+        delete remote_buckets;
+        remote_buckets = nullptr;
+    }
+    if (remote_stored != nullptr)
+    {
+        delete remote_stored;
+        remote_stored = nullptr;
+    }
+    manifest_deinit();
+    dedup_deinit();
+    blockdir = nullptr;
+}
+
+/**
+ * Get the generation of the volume.  It changes whenever a mount
+ * first stores an extent.
+ *
+ * @return The generation
+ */
+uint64_t remote_generation()
+{
+    uint64_t generation;
+
+    pthread_mutex_lock(&remote_generation_lock);
+    generation = remote_generation_value;
+    pthread_mutex_unlock(&remote_generation_lock);
+
+    return generation;
+}
+
+/**
+ * Advance the generation of the volume, if that has not already been
+ * done by this mount.
+ *
+ * @return A boolean indicating whether the generation has been advanced
+ */
+static bool remote_advance_generation()
+{
+    char filename[0x100];
+    char generation[0x20];
+    VSILFILE *handle = NULL;
+    bool advanced;
+
+    pthread_mutex_lock(&remote_generation_lock);
+    if (!remote_generation_advanced)
+    {
+        sprintf(filename, GENERATION_TEMPLATE, blockdir);
+        sprintf(generation, "%lu\n", remote_generation_value + 1);
+        if ((handle = VSIFOpenL(filename, "w")) != NULL)
+        {
+            bool ok = (VSIFWriteL(generation, strlen(generation), 1, handle) == 1);
+            VSIFFlushL(handle);
+            if ((VSIFCloseL(handle) == 0) && ok)
+            {
+                remote_generation_value++;
+                remote_generation_advanced = true;
+            }
+        }
+    }
+    advanced = remote_generation_advanced;
+    pthread_mutex_unlock(&remote_generation_lock);
+
+    return advanced;
+}
+
+/**
+ * Get the bucket responsible for an extent.
+ *
+ * @param extent_tag The tag of the extent
+ * @return A reference to the bucket
+ */
+static inline remote_bucket_t &remote_bucket(uint64_t extent_tag)
+{
+    auto index = remote_bucket_hash(extent_tag) % remote_buckets->size();
+    return remote_buckets->operator[](index);
+}
+
+/**
+ * Whether an extent is known to be stored encoded.  A ranged fetch of
+ * such an extent costs as much as fetching all of it.
+ *
+ * @param extent_tag The tag of the extent
+ * @return True if the extent was last seen stored encoded
+ */
+bool remote_encoded(uint64_t extent_tag)
+{
+    auto &bucket = remote_bucket(extent_tag);
+    bool encoded;
+
+    pthread_mutex_lock(&bucket.lock);
+    encoded = (bucket.encoded.count(extent_tag) != 0);
+    pthread_mutex_unlock(&bucket.lock);
+
+    return encoded;
+}
+
+/**
+ * Whether an extent is known to be stored as all zeros, either
+ * because it was last seen that way or because the manifest says so.
+ * Such an extent can be read without going to remote storage.
+ *
+ * @param extent_tag The tag of the extent
+ * @return True if the extent is stored as zeros
+ */
+bool remote_zero(uint64_t extent_tag)
+{
+    auto &bucket = remote_bucket(extent_tag);
+    bool zero;
+
+    pthread_mutex_lock(&bucket.lock);
+    zero = (bucket.zero.count(extent_tag) != 0);
+    pthread_mutex_unlock(&bucket.lock);
+
+    return zero || manifest_zero(extent_tag);
+}
+
+/**
+ * Whether the contents of an extent are known without reading it:
+ * either it is stored as all zeros, or it has never been stored.
+ *
+ * @param extent_tag The tag of the extent
+ * @param fill The return pointer for the value of every byte of the extent
+ * @return True if the contents are known
+ */
+bool remote_synthetic(uint64_t extent_tag, uint8_t *fill)
+{
+    auto &bucket = remote_bucket(extent_tag);
+    bool absent;
+
+    pthread_mutex_lock(&bucket.lock);
+    absent = (bucket.absent.count(extent_tag) != 0);
+    pthread_mutex_unlock(&bucket.lock);
+
+    if (remote_zero(extent_tag))
+    {
+        *fill = 0x00;
+        return true;
+    }
+    else if (absent || manifest_absent(extent_tag))
+    {
+        *fill = 0x33;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Record how an extent is stored.
+ *
+ * @param extent_tag The tag of the extent
+ * @param object The first bytes of the object, or nullptr if it is raw
+ */
+static void remote_set_format(uint64_t extent_tag, const uint8_t *object)
+{
+    auto &bucket = remote_bucket(extent_tag);
+    bool encoded = (object != nullptr);
+    bool zero = (object != nullptr && object[5] == CODEC_ZERO);
+
+    pthread_mutex_lock(&bucket.lock);
+    bucket.absent.erase(extent_tag);
+    if (encoded)
+    {
+        bucket.encoded.insert(extent_tag);
+    }
+    else
+    {
+        bucket.encoded.erase(extent_tag);
+    }
+    if (zero)
+    {
+        bucket.zero.insert(extent_tag);
+    }
+    else
+    {
+        bucket.zero.erase(extent_tag);
+    }
+    pthread_mutex_unlock(&bucket.lock);
+}
+
+/**
+ * Read ranges of an extent from an open object.  Raw objects are read
+ * directly, with several ranges requested together so that they can
+ * be merged into fewer requests; encoded objects are read and decoded
+ * whole.
+ *
+ * @param handle The open object
+ * @param extent_tag The tag of the extent
+ * @param count The number of ranges
+ * @param offsets The offsets of the ranges within the extent
+ * @param sizes The sizes of the ranges
+ * @param bytes The arrays in which to return the bytes of each range
+ * @return A boolean indicating success or failure
+ */
+static bool remote_read(VSILFILE *handle, uint64_t extent_tag, size_t count, const uint64_t *offsets, const uint64_t *sizes, uint8_t **bytes)
+{
+    if (VSIFSeekL(handle, 0, SEEK_END) != 0)
+    {
+        return false;
+    }
+    uint64_t object_size = VSIFTellL(handle);
+
+    remote_reads++;
+    if (object_size == EXTENT_SIZE)
+    {
+        remote_set_format(extent_tag, nullptr);
+        if (count == 1)
+        {
+            if (VSIFSeekL(handle, offsets[0], SEEK_SET) != 0 || VSIFReadL(bytes[0], sizes[0], 1, handle) != 1)
+            {
+                return false;
+            }
+            remote_bytes_fetched += sizes[0];
+            return true;
+        }
+
+        std::vector<void *> datas(bytes, bytes + count);
+        std::vector<vsi_l_offset> range_offsets(offsets, offsets + count);
+        std::vector<size_t> range_sizes(sizes, sizes + count);
+        if (VSIFReadMultiRangeL(count, datas.data(), range_offsets.data(), range_sizes.data(), handle) != 0)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            remote_bytes_fetched += sizes[i];
+        }
+        return true;
+    }
+
+    bool whole = (count == 1 && offsets[0] == 0 && sizes[0] == EXTENT_SIZE);
+    uint8_t *object = new uint8_t[object_size];
+    uint8_t *extent = whole ? bytes[0] : new uint8_t[EXTENT_SIZE];
+    bool ok = (VSIFSeekL(handle, 0, SEEK_SET) == 0 &&
+               VSIFReadL(object, object_size, 1, handle) == 1 &&
+               codec_decode(object, object_size, extent));
+
+    if (ok)
+    {
+        remote_set_format(extent_tag, object);
+        remote_bytes_fetched += object_size;
+        for (size_t i = 0; i < count && !whole; ++i)
+        {
+            memcpy(bytes[i], extent + offsets[i], sizes[i]);
+        }
+    }
+    if (!whole)
+    {
+        delete[] extent;
+    }
+    delete[] object;
+
+    return ok;
+}
+
+/**
+ * Find the content hash of the extent stored at a position.  The
+ * reference object is read the first time, and remembered.  A volume
+ * that has ever stored by content is searched for references whether
+ * or not this mount does.
+ *
+ * @param extent_tag The tag of the extent
+ * @param hash The return pointer for the hash
+ * @return A boolean indicating whether the position holds a reference
+ */
+bool remote_hash(uint64_t extent_tag, std::string *hash)
+{
+    auto &bucket = remote_bucket(extent_tag);
+    char filename[0x100];
+    char ref[0x100] = {};
+    VSILFILE *handle = NULL;
+    bool known, absent;
+
+    if (!volume_content_layout())
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&bucket.lock);
+    auto itr = bucket.refs.find(extent_tag);
+    known = (itr != bucket.refs.end());
+    if (known)
+    {
+        *hash = itr->second;
+    }
+    absent = (bucket.absent.count(extent_tag) != 0);
+    pthread_mutex_unlock(&bucket.lock);
+
+    if (known)
+    {
+        return !hash->empty();
+    }
+    else if (absent || manifest_absent(extent_tag))
+    {
+        return false;
+    }
+
+    // Read the reference, if there is one
+    sprintf(filename, REF_TEMPLATE, blockdir, extent_tag);
+    if ((handle = VSIFOpenL(filename, "r")) != NULL)
+    {
+        VSIFReadL(ref, 1, sizeof(ref) - 1, handle);
+        VSIFCloseL(handle);
+    }
+    *hash = std::string{ref};
+
+    pthread_mutex_lock(&bucket.lock);
+    bucket.refs[extent_tag] = *hash;
+    pthread_mutex_unlock(&bucket.lock);
+
+    return !hash->empty();
+}
+
+/**
+ * Read ranges of an extent from remote storage.  Extents that have
+ * never been stored read as a fill pattern, and are remembered as
+ * absent so that they need not be looked for again.  An extent whose
+ * object exists but cannot be read is a failure, not a fill.
+ *
+ * @param extent_tag The tag of the extent
+ * @param count The number of ranges
+ * @param offsets The offsets of the ranges within the extent
+ * @param sizes The sizes of the ranges
+ * @param bytes The arrays in which to return the bytes of each range
+ * @return A boolean indicating success or failure
+ */
+bool remote_fetch_ranges(uint64_t extent_tag, size_t count, const uint64_t *offsets, const uint64_t *sizes, uint8_t **bytes)
+{
+    assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
+
+    auto &bucket = remote_bucket(extent_tag);
+    char filename[0x200];
+    VSILFILE *handle = NULL;
+    std::string hash;
+    bool absent;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        assert(offsets[i] + sizes[i] <= EXTENT_SIZE);
+    }
+
+    pthread_mutex_lock(&bucket.lock);
+    absent = (bucket.absent.count(extent_tag) != 0);
+    pthread_mutex_unlock(&bucket.lock);
+
+    // Extents known to be zeros need not be read, and neither do
+    // extents that the manifest says were never stored
+    if (remote_zero(extent_tag))
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            memset(bytes[i], 0, sizes[i]);
+        }
+        return true;
+    }
+    absent = absent || manifest_absent(extent_tag);
+
+    // If possible, read the ranges from remote storage, either from
+    // the content the extent refers to or from its own object
+    if (remote_hash(extent_tag, &hash))
+    {
+        snprintf(filename, sizeof(filename), "%s", dedup_object_name(hash).c_str());
+    }
+    else
+    {
+        sprintf(filename, EXTENT_TEMPLATE, blockdir, extent_tag);
+    }
+    if (!absent && (handle = VSIFOpenL(filename, "r")) != NULL)
+    {
+        bool ok = remote_read(handle, extent_tag, count, offsets, sizes, bytes);
+        VSIFCloseL(handle);
+        return ok;
+    }
+
+    // Otherwise, remember that the extent is absent and fill, but only
+    // if the object is certainly not there: a failure to open one that
+    // is must not turn the extent into fill that is later stored over it
+    if (!absent)
+    {
+        VSIStatBufL stat;
+
+        errno = 0;
+        if (VSIStatL(filename, &stat) == 0 || (errno != 0 && errno != ENOENT))
+        {
+            return false;
+        }
+        pthread_mutex_lock(&bucket.lock);
+        bucket.absent.insert(extent_tag);
+        pthread_mutex_unlock(&bucket.lock);
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        memset(bytes[i], 0x33, sizes[i]);
+    }
+    return true;
+}
+
+/**
+ * Read a range of an extent from remote storage.
+ *
+ * @param extent_tag The tag of the extent
+ * @param offset The offset of the range within the extent
+ * @param size The size of the range
+ * @param bytes The array in which to return the bytes
+ * @return A boolean indicating success or failure
+ */
+bool remote_fetch(uint64_t extent_tag, uint64_t offset, uint64_t size, uint8_t *bytes)
+{
+    return remote_fetch_ranges(extent_tag, 1, &offset, &size, &bytes);
+}
+
+/**
+ * Write an object: either an encoded extent or, if there is no
+ * encoding, the raw extent.
+ *
+ * @param filename The name of the object
+ * @param extent The contents of the extent
+ * @param object The encoded extent
+ * @param object_size The size of the encoded extent, or 0 if there is none
+ * @return A boolean indicating success or failure
+ */
+static bool remote_write(const char *filename, const uint8_t *extent, const uint8_t *object, size_t object_size)
+{
+    VSILFILE *handle = NULL;
+
+    // Open extent file for writing
+    if ((handle = VSIFOpenL(filename, "w")) == NULL)
+    {
+        return false;
+    }
+
+    // Write the encoded object, or the whole extent, in one operation
+    const uint8_t *data = (object_size > 0) ? object : extent;
+    size_t size = (object_size > 0) ? object_size : EXTENT_SIZE;
+    if (VSIFWriteL(data, size, 1, handle) != 1)
+    {
+        VSIFCloseL(handle);
+        return false;
+    }
+
+    // Close extent file
+    VSIFFlushL(handle);
+    return (VSIFCloseL(handle) == 0);
+}
+
+/**
+ * Write a complete extent to remote storage by content.  The content
+ * is uploaded only if it is not already stored; then the position is
+ * pointed at it.
+ *
+ * @param extent_tag The tag of the extent
+ * @param extent The contents of the extent
+ * @param object The encoded extent
+ * @param object_size The size of the encoded extent, or 0 if there is none
+ * @return The number of bytes uploaded, or -1 on failure
+ */
+static int64_t remote_store_content(uint64_t extent_tag, const uint8_t *extent, const uint8_t *object, size_t object_size)
+{
+    auto &bucket = remote_bucket(extent_tag);
+    std::string hash = dedup_hash(extent);
+    std::string name = dedup_object_name(hash);
+    char filename[0x100];
+    int64_t uploaded = 0;
+    VSIStatBufL stat;
+    VSILFILE *handle = NULL;
+    bool stored;
+
+    // The volume must say that it holds references before it does
+    if (!volume_use_content_layout())
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&remote_stored_lock);
+    stored = (remote_stored->count(hash) != 0);
+    pthread_mutex_unlock(&remote_stored_lock);
+
+    // Upload the content unless it is already there
+    if (!stored && VSIStatL(name.c_str(), &stat) != 0)
+    {
+        if (!remote_write(name.c_str(), extent, object, object_size))
+        {
+            return -1;
+        }
+        uploaded = (object_size > 0) ? object_size : EXTENT_SIZE;
+    }
+    else
+    {
+        remote_dedup_hits++;
+    }
+    pthread_mutex_lock(&remote_stored_lock);
+    remote_stored->insert(hash);
+    pthread_mutex_unlock(&remote_stored_lock);
+
+    // Point the position at it
+    sprintf(filename, REF_TEMPLATE, blockdir, extent_tag);
+    if ((handle = VSIFOpenL(filename, "w")) == NULL)
+    {
+        return -1;
+    }
+    if (VSIFWriteL(hash.c_str(), hash.size(), 1, handle) != 1)
+    {
+        VSIFCloseL(handle);
+        return -1;
+    }
+    VSIFFlushL(handle);
+    if (VSIFCloseL(handle) != 0)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&bucket.lock);
+    bucket.refs[extent_tag] = hash;
+    pthread_mutex_unlock(&bucket.lock);
+
+    return uploaded + hash.size();
+}
+
+/**
+ * Remove the reference at a position, so that its own object is read.
+ * This is done after that object is written, so that the position
+ * never reads as anything older than the content it referred to.
+ *
+ * @param extent_tag The tag of the extent
+ * @return A boolean indicating whether the position holds no reference
+ */
+static bool remote_unref(uint64_t extent_tag)
+{
+    auto &bucket = remote_bucket(extent_tag);
+    char filename[0x100];
+    VSIStatBufL stat;
+    bool none;
+
+    pthread_mutex_lock(&bucket.lock);
+    auto itr = bucket.refs.find(extent_tag);
+    none = (itr != bucket.refs.end() && itr->second.empty());
+    pthread_mutex_unlock(&bucket.lock);
+
+    if (!none)
+    {
+        sprintf(filename, REF_TEMPLATE, blockdir, extent_tag);
+        if (VSIUnlink(filename) != 0 && VSIStatL(filename, &stat) == 0)
+        {
+            return false;
+        }
+        pthread_mutex_lock(&bucket.lock);
+        bucket.refs[extent_tag] = std::string{};
+        pthread_mutex_unlock(&bucket.lock);
+    }
+
+    return true;
+}
+
+/**
+ * Write a complete extent to remote storage, encoded with the
+ * configured codec if that makes it smaller, and stored by content if
+ * deduplication is enabled.  Otherwise any reference the position
+ * held is removed.
+ *
+ * @param extent_tag The tag of the extent
+ * @param extent The contents of the extent
+ * @return A boolean indicating success or failure
+ */
+bool remote_store(uint64_t extent_tag, const uint8_t *extent)
+{
+    assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
+
+    char filename[0x100];
+    uint8_t *object = new uint8_t[codec_bound()];
+    size_t object_size = codec_encode(extent, object);
+    bool encoded = (object_size > 0);
+    bool zero = (encoded && object[5] == CODEC_ZERO);
+    int64_t uploaded = -1;
+
+    // The generation and the manifest must both be up to date before
+    // the extent exists, and the manifest must not say that it is zeros
+    // unless it is
+    if (!remote_advance_generation() ||
+        !manifest_insert(extent_tag) ||
+        (!zero && !manifest_set_zero(extent_tag, false)))
+    {
+        delete[] object;
+        return false;
+    }
+
+    if (dedup_enabled())
+    {
+        uploaded = remote_store_content(extent_tag, extent, object, object_size);
+    }
+    else
+    {
+        sprintf(filename, EXTENT_TEMPLATE, blockdir, extent_tag);
+        if (remote_write(filename, extent, object, object_size) &&
+            (!volume_content_layout() || remote_unref(extent_tag)))
+        {
+            uploaded = encoded ? object_size : EXTENT_SIZE;
+        }
+    }
+    if (uploaded < 0)
+    {
+        delete[] object;
+        return false;
+    }
+
+    remote_bytes_stored += uploaded;
+    remote_set_format(extent_tag, encoded ? object : nullptr);
+    if (zero)
+    {
+        // If this is not recorded, the extent is only read once more
+        manifest_set_zero(extent_tag, true);
+        remote_zero_extents++;
+    }
+    delete[] object;
+
+    return true;
+}
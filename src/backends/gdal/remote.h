@@ -0,0 +1,43 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __REMOTE_H__
+#define __REMOTE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+void remote_init(const char *_blockdir);
+void remote_deinit();
+uint64_t remote_generation();
+bool remote_encoded(uint64_t extent_tag);
+bool remote_zero(uint64_t extent_tag);
+bool remote_synthetic(uint64_t extent_tag, uint8_t *fill);
+bool remote_hash(uint64_t extent_tag, std::string *hash);
+bool remote_fetch_ranges(uint64_t extent_tag, size_t count, const uint64_t *offsets, const uint64_t *sizes, uint8_t **bytes);
+bool remote_fetch(uint64_t extent_tag, uint64_t offset, uint64_t size, uint8_t *bytes);
+bool remote_store(uint64_t extent_tag, const uint8_t *extent);
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cassert>
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include "constants.h"
+#include "residency.h"
+
+static_assert(EXTENT_MIN_PAGES % 64 == 0, "An extent must be a whole number of bitmap words");
+
+typedef std::vector<uint64_t> residency_bitmap_t; // One bit per page, set if the page is in the scratch file
+
+typedef std::map<uint64_t, residency_bitmap_t> residency_map_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    residency_map_t bitmaps;
+} residency_bucket_t;
+
+typedef std::vector<residency_bucket_t> residency_buckets_t;
+
+static std::hash<uint64_t> residency_bucket_hash = std::hash<uint64_t>{};
+static residency_buckets_t *residency_buckets = nullptr;
+
+/**
+ * Initialize residency tracking.  Nothing is resident to begin with.
+ */
+void residency_init()
+{
+    if (residency_buckets == nullptr)
+    {
+        residency_buckets = new residency_buckets_t{};
+        for (size_t i = 0; i < EXTENT_BUCKETS; ++i)
+        {
+            residency_buckets->push_back(residency_bucket_t{
+                PTHREAD_MUTEX_INITIALIZER,
+                residency_map_t{}});
+        }
+    }
+}
+
+/**
+ * Deinitialize residency tracking.
+ */
+void residency_deinit()
+{
+    if (residency_buckets != nullptr)
+    {
+        delete residency_buckets;
+        residency_buckets = nullptr;
+    }
+}
+
+/**
+ * Get the bucket responsible for an extent.
+ *
+ * @param extent_tag The tag of the extent
+ * @return A reference to the bucket
+ */
+static inline residency_bucket_t &residency_bucket(uint64_t extent_tag)
+{
+    auto index = residency_bucket_hash(extent_tag) % residency_buckets->size();
+    return residency_buckets->operator[](index);
+}
+
+/**
+ * Find the first page at or after an offset, within the same extent,
+ * whose residency is as given.
+ *
+ * @param offset The offset to search from
+ * @param resident True to look for a resident page, false to look for a missing one
+ * @return The offset of the page, or the end of the extent if there is none
+ */
+static uint64_t residency_next(uint64_t offset, bool resident)
+{
+    uint64_t extent_tag = offset & (~EXTENT_MASK);
+    uint64_t page = (offset - extent_tag) / PAGE_SIZE;
+    auto &bucket = residency_bucket(extent_tag);
+
+    pthread_mutex_lock(&bucket.lock);
+    auto itr = bucket.bitmaps.find(extent_tag);
+    if (itr == bucket.bitmaps.end())
+    {
+        pthread_mutex_unlock(&bucket.lock);
+        return resident ? extent_tag + EXTENT_SIZE : offset & (~PAGE_MASK);
+    }
+    while (page < PAGES_PER_EXTENT)
+    {
+        uint64_t word = itr->second[page / 64];
+        word = (resident ? word : ~word) >> (page % 64);
+        if (word != 0)
+        {
+            page += __builtin_ctzll(word);
+            break;
+        }
+        page = (page + 64) & (~static_cast<uint64_t>(63));
+    }
+    pthread_mutex_unlock(&bucket.lock);
+
+    return extent_tag + (std::min(page, PAGES_PER_EXTENT) * PAGE_SIZE);
+}
+
+/**
+ * Find the first page at or after an offset that is missing from the
+ * scratch file.  Only the extent containing the offset is searched.
+ *
+ * @param offset The offset to search from
+ * @return The offset of the page, or the end of the extent if there is none
+ */
+uint64_t residency_next_hole(uint64_t offset)
+{
+    return residency_next(offset, false);
+}
+
+/**
+ * Find the first page at or after an offset that is present in the
+ * scratch file.  Only the extent containing the offset is searched.
+ *
+ * @param offset The offset to search from
+ * @return The offset of the page, or the end of the extent if there is none
+ */
+uint64_t residency_next_data(uint64_t offset)
+{
+    return residency_next(offset, true);
+}
+
+/**
+ * Record that a range of pages, all within one extent, is now present
+ * in the scratch file.
+ *
+ * @param begin The offset of the first page
+ * @param end The offset just past the last page
+ */
+void residency_mark(uint64_t begin, uint64_t end)
+{
+    uint64_t extent_tag = begin & (~EXTENT_MASK);
+    auto &bucket = residency_bucket(extent_tag);
+
+    assert(begin == (begin & (~PAGE_MASK)) && end == (end & (~PAGE_MASK)));
+    assert(extent_tag < end && end <= extent_tag + EXTENT_SIZE);
+
+    pthread_mutex_lock(&bucket.lock);
+    auto &bitmap = bucket.bitmaps[extent_tag];
+    if (bitmap.empty())
+    {
+        bitmap.resize(PAGES_PER_EXTENT / 64, 0);
+    }
+    for (uint64_t page = (begin - extent_tag) / PAGE_SIZE; page < (end - extent_tag) / PAGE_SIZE; ++page)
+    {
+        bitmap[page / 64] |= (static_cast<uint64_t>(1) << (page % 64));
+    }
+    pthread_mutex_unlock(&bucket.lock);
+}
+
+/**
+ * Record that an extent is no longer present in the scratch file.
+ *
+ * @param extent_tag The tag of the extent
+ */
+void residency_clear(uint64_t extent_tag)
+{
+    assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
+
+    auto &bucket = residency_bucket(extent_tag);
+
+    pthread_mutex_lock(&bucket.lock);
+    bucket.bitmaps.erase(extent_tag);
+    pthread_mutex_unlock(&bucket.lock);
+}
+
+/**
+ * List the extents that are at least partly present in the scratch
+ * file.
+ *
+ * @param extent_tags The return pointer for the tags of the extents
+ */
+void residency_extents(std::vector<uint64_t> *extent_tags)
+{
+    extent_tags->clear();
+    for (auto &bucket : *residency_buckets)
+    {
+        pthread_mutex_lock(&bucket.lock);
+        for (auto &bitmap : bucket.bitmaps)
+        {
+            extent_tags->push_back(bitmap.first);
+        }
+        pthread_mutex_unlock(&bucket.lock);
+    }
+}
@@ -27,59 +27,135 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
 
+#include <cassert>
+#include <cstring>
+#include <functional>
+#include <map>
 #include <vector>
 
 #include "constants.h"
 #include "scratch.h"
+#include "fullio.h"
+#include "metrics.h"
+#include "uring.h"
+
+typedef std::map<uint64_t, uint8_t *> scratch_window_map_t;
 
 typedef struct
 {
     pthread_mutex_t lock;
-    int fd;
-} locked_fd_t;
+    scratch_window_map_t windows;
+} scratch_bucket_t;
+
+typedef std::vector<scratch_bucket_t> scratch_buckets_t;
 
-typedef std::vector<locked_fd_t> locked_fd_vector_t;
+static int scratch_fd = -1;
+static char scratch_filename[0x100] = {};
+static std::hash<uint64_t> scratch_bucket_hash = std::hash<uint64_t>{};
+static scratch_buckets_t *scratch_buckets = nullptr;
 
-static locked_fd_vector_t *locked_fd_vector = nullptr;
+static metric_t &scratch_unmapped = metric_register("scratch_unmapped");
 
 /**
- * Initialize scratch file functionality.
+ * Initialize scratch file functionality.  All access to the scratch
+ * file is positional, so a single descriptor is shared by all
+ * threads.  If the S3BD_SCRATCH_MMAP environment variable is set,
+ * extents are accessed through extent-sized mappings of the file
+ * instead.  Otherwise, if the S3BD_SCRATCH_URING environment variable
+ * is set and io_uring is available, reads, writes, and hole punches go
+ * through io_uring.  If the S3BD_PERSISTENT_CACHE environment variable is set,
+ * the scratch file is named after its value rather than the process,
+ * and is kept so that a later mount can use its contents; it is locked,
+ * so that only one mount at a time uses it.
+ *
+ * @return A boolean indicating success, or failure if the scratch file cannot be opened or is in use
  */
-void scratch_init()
+bool scratch_init()
 {
-    char *scratch_dir = nullptr;
-    char scratch_filename[0x100];
+    const char *scratch_dir = nullptr;
+    const char *cache_name = getenv(S3BD_PERSISTENT_CACHE);
 
-    // Initialize file descriptor list
-    scratch_dir = getenv(S3BD_SCRATCH_DIR);
-    if (scratch_dir != nullptr)
+    // Open the scratch file
+    if ((scratch_dir = getenv(S3BD_SCRATCH_DIR)) == nullptr)
     {
-        sprintf(scratch_filename, SCRATCH_TEMPLATE, scratch_dir, getpid());
+        scratch_dir = SCRATCH_DEFAULT_DIR;
+    }
+    if (cache_name != nullptr)
+    {
+        sprintf(scratch_filename, SCRATCH_PERSISTENT_TEMPLATE, scratch_dir, cache_name);
     }
     else
     {
-        sprintf(scratch_filename, SCRATCH_TEMPLATE, SCRATCH_DEFAULT_DIR, getpid());
+        sprintf(scratch_filename, SCRATCH_TEMPLATE, scratch_dir, getpid());
     }
-    if (locked_fd_vector == nullptr)
+    if (scratch_fd == -1)
+    {
+        scratch_fd = open(scratch_filename, O_RDWR | O_CREAT, S_IRWXU);
+
+        // A second mount of the same persistent cache would empty or
+        // overwrite the scratch file under the first one
+        if (scratch_fd != -1 && cache_name != nullptr && flock(scratch_fd, LOCK_EX | LOCK_NB) != 0)
+        {
+            close(scratch_fd);
+            scratch_fd = -1;
+        }
+    }
+    if (scratch_fd == -1)
+    {
+        return false;
+    }
+
+    // Prepare to map extents if asked to
+    if (getenv(S3BD_SCRATCH_MMAP) != nullptr && scratch_buckets == nullptr)
     {
-        locked_fd_vector = new locked_fd_vector_t{};
-        for (size_t i = 0; i < SCRATCH_DESCRIPTORS; ++i)
+        scratch_buckets = new scratch_buckets_t{};
+        for (size_t i = 0; i < EXTENT_BUCKETS; ++i)
         {
-            locked_fd_vector->push_back(locked_fd_t{
+            scratch_buckets->push_back(scratch_bucket_t{
                 PTHREAD_MUTEX_INITIALIZER,
-                open(scratch_filename, O_RDWR | O_CREAT, S_IRWXU)});
+                scratch_window_map_t{}});
         }
     }
 
+    // Otherwise use io_uring if asked to (and if it is there)
+    if (getenv(S3BD_SCRATCH_URING) != nullptr && scratch_buckets == nullptr)
+    {
+        uring_init(scratch_fd);
+    }
+
     // Unlink scratch file if not told to keep it
-    if (getenv(S3BD_KEEP_SCRATCH_FILE) == nullptr)
+    if (getenv(S3BD_KEEP_SCRATCH_FILE) == nullptr && cache_name == nullptr)
     {
         unlink(scratch_filename);
     }
+
+    return true;
+}
+
+/**
+ * Drop every mapping of the scratch file.  No extent may be in use.
+ */
+static void scratch_unmap()
+{
+    if (scratch_buckets != nullptr)
+    {
+        for (auto &bucket : *scratch_buckets)
+        {
+            pthread_mutex_lock(&bucket.lock);
+            for (auto &window : bucket.windows)
+            {
+                munmap(window.second, EXTENT_SIZE);
+            }
+            bucket.windows.clear();
+            pthread_mutex_unlock(&bucket.lock);
+        }
+    }
 }
 
 /**
@@ -87,54 +163,247 @@ void scratch_init()
  */
 void scratch_deinit()
 {
-    if (locked_fd_vector != nullptr)
+    if (scratch_buckets != nullptr)
+    {
+        scratch_unmap();
+        delete scratch_buckets;
+        scratch_buckets = nullptr;
+    }
+    uring_deinit();
+    if (scratch_fd != -1)
     {
-        for (size_t i = 0; i < SCRATCH_DESCRIPTORS; ++i)
+        close(scratch_fd);
+        scratch_fd = -1;
+    }
+}
+
+/**
+ * Get the mapping of an extent of the scratch file, creating it if
+ * necessary.  The blocks behind the mapping are allocated first
+ * (growing the file as needed), because a store to a page that the
+ * filesystem cannot then allocate raises SIGBUS.  If they cannot be
+ * allocated (for instance, if the disk is full), the extent is not
+ * mapped, and is read and written with pread and pwrite instead,
+ * which report the error.
+ *
+ * @param extent_tag The tag of the extent
+ * @return A pointer to the start of the extent, or nullptr if it is not mapped
+ */
+uint8_t *scratch_extent(uint64_t extent_tag)
+{
+    assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
+
+    if (scratch_buckets == nullptr)
+    {
+        return nullptr;
+    }
+
+    auto index = scratch_bucket_hash(extent_tag) % scratch_buckets->size();
+    auto &bucket = scratch_buckets->operator[](index);
+    uint8_t *window = nullptr;
+
+    pthread_mutex_lock(&bucket.lock);
+    auto itr = bucket.windows.find(extent_tag);
+    if (itr != bucket.windows.end())
+    {
+        window = itr->second;
+    }
+    else if (fallocate(scratch_fd, 0, extent_tag, EXTENT_SIZE) != 0)
+    {
+        scratch_unmapped++;
+    }
+    else
+    {
+        void *address = mmap(NULL, EXTENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, scratch_fd, extent_tag);
+        if (address != MAP_FAILED)
         {
-            close(locked_fd_vector->operator[](i).fd);
+            window = reinterpret_cast<uint8_t *>(address);
+            bucket.windows.insert(std::make_pair(extent_tag, window));
         }
-        delete locked_fd_vector;
-        locked_fd_vector = nullptr;
     }
+    pthread_mutex_unlock(&bucket.lock);
+
+    return window;
 }
 
 /**
- * Acquire a handle to a file descriptor for the scratch file.
+ * Read bytes from the scratch file.
  *
- * @return A handle that is mappable to a file descriptor.
+ * @param bytes The array in which to return the bytes
+ * @param size The number of bytes to read
+ * @param offset The offset in the scratch file to read from
  */
-size_t aquire_scratch_handle()
+void scratch_pread(void *bytes, size_t size, uint64_t offset)
 {
-    for (size_t i = 0; true; ++i)
+    uint64_t extent_tag = offset & (~EXTENT_MASK);
+    uint8_t *window = scratch_extent(extent_tag);
+
+    if (window != nullptr)
+    {
+        assert(offset + size <= extent_tag + EXTENT_SIZE);
+        memcpy(bytes, window + (offset - extent_tag), size);
+    }
+    else if (!uring_rw(false, 1, &bytes, &size, &offset))
     {
-        size_t handle = i % SCRATCH_DESCRIPTORS;
-        pthread_mutex_t *lock = &(locked_fd_vector->operator[](handle).lock);
+        fullpread(scratch_fd, bytes, size, offset);
+    }
+}
 
-        if (pthread_mutex_trylock(lock) == 0)
+/**
+ * Read several ranges of the scratch file at once.
+ *
+ * @param count The number of ranges
+ * @param bytes The arrays in which to return the bytes of each range
+ * @param sizes The sizes of the ranges
+ * @param offsets The offsets in the scratch file of the ranges
+ */
+void scratch_preadv(size_t count, void *const *bytes, const size_t *sizes, const uint64_t *offsets)
+{
+    if (scratch_buckets != nullptr || !uring_rw(false, count, bytes, sizes, offsets))
+    {
+        for (size_t i = 0; i < count; ++i)
         {
-            return handle;
+            scratch_pread(bytes[i], sizes[i], offsets[i]);
         }
     }
 }
 
 /**
- * Translate a previously-acquired handle into file descriptor for the
- * scratch file.
+ * Write bytes to the scratch file.
  *
- * @param handle A previously-acquired handle
+ * @param bytes The array from which to write the bytes
+ * @param size The number of bytes to write
+ * @param offset The offset in the scratch file to write to
  */
-int scratch_handle_to_fd(size_t handle)
+void scratch_pwrite(const void *bytes, size_t size, uint64_t offset)
 {
-    return locked_fd_vector->operator[](handle).fd;
+    uint64_t extent_tag = offset & (~EXTENT_MASK);
+    uint8_t *window = scratch_extent(extent_tag);
+
+    if (window != nullptr)
+    {
+        assert(offset + size <= extent_tag + EXTENT_SIZE);
+        memcpy(window + (offset - extent_tag), bytes, size);
+    }
+    else
+    {
+        void *array = const_cast<void *>(bytes);
+
+        if (!uring_rw(true, 1, &array, &size, &offset))
+        {
+            fullpwrite(scratch_fd, bytes, size, offset);
+        }
+    }
+}
+
+/**
+ * Write several ranges of the scratch file at once.
+ *
+ * @param count The number of ranges
+ * @param bytes The arrays from which to write the bytes of each range
+ * @param sizes The sizes of the ranges
+ * @param offsets The offsets in the scratch file of the ranges
+ */
+void scratch_pwritev(size_t count, const void *const *bytes, const size_t *sizes, const uint64_t *offsets)
+{
+    if (scratch_buckets != nullptr || !uring_rw(true, count, const_cast<void *const *>(bytes), sizes, offsets))
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            scratch_pwrite(bytes[i], sizes[i], offsets[i]);
+        }
+    }
+}
+
+/**
+ * Punch a hole in the scratch file.  If the hole covers a whole
+ * mapped extent, the mapping is dropped as well so that the memory
+ * behind it is released.
+ *
+ * @param offset The offset of the hole
+ * @param size The size of the hole
+ */
+void scratch_punch(uint64_t offset, uint64_t size)
+{
+    if (scratch_buckets != nullptr && size == EXTENT_SIZE && (offset & EXTENT_MASK) == 0)
+    {
+        auto index = scratch_bucket_hash(offset) % scratch_buckets->size();
+        auto &bucket = scratch_buckets->operator[](index);
+
+        pthread_mutex_lock(&bucket.lock);
+        auto itr = bucket.windows.find(offset);
+        if (itr != bucket.windows.end())
+        {
+            madvise(itr->second, EXTENT_SIZE, MADV_DONTNEED);
+            munmap(itr->second, EXTENT_SIZE);
+            bucket.windows.erase(itr);
+        }
+        pthread_mutex_unlock(&bucket.lock);
+    }
+    if (!uring_punch(offset, size))
+    {
+        fallocate(scratch_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size);
+    }
+}
+
+/**
+ * Get a buffer of the calling thread that the scratch file can be
+ * read into and written from cheaply.
+ *
+ * @return An extent-sized buffer, or nullptr if there is no such thing
+ */
+uint8_t *scratch_buffer()
+{
+    return uring_buffer();
+}
+
+/**
+ * Get the descriptor of the scratch file, for reading and writing it
+ * directly.  The scratch file is laid out like the device.
+ *
+ * @return The descriptor
+ */
+int scratch_descriptor()
+{
+    return scratch_fd;
 }
 
 /**
- * Release a scratch file handle.
+ * Get the name of the scratch file.
  *
- * @param handle The handle to release
+ * @return The name
+ */
+const char *scratch_name()
+{
+    return scratch_filename;
+}
+
+/**
+ * Make the contents of the scratch file durable.
+ */
+void scratch_sync()
+{
+    if (scratch_buckets != nullptr)
+    {
+        for (auto &bucket : *scratch_buckets)
+        {
+            pthread_mutex_lock(&bucket.lock);
+            for (auto &window : bucket.windows)
+            {
+                msync(window.second, EXTENT_SIZE, MS_SYNC);
+            }
+            pthread_mutex_unlock(&bucket.lock);
+        }
+    }
+    fdatasync(scratch_fd);
+}
+
+/**
+ * Discard the contents of the scratch file.  No extent may be in use.
+ * Mappings are dropped too, since they would no longer be backed.
  */
-void release_scratch_handle(size_t handle)
+void scratch_clear()
 {
-    pthread_mutex_t *lock = &(locked_fd_vector->operator[](handle).lock);
-    pthread_mutex_unlock(lock);
+    scratch_unmap();
+    ftruncate(scratch_fd, 0);
 }
@@ -26,11 +26,20 @@
 #define __SCRATCH_H__
 
 #include <cstddef>
+#include <cstdint>
 
-void scratch_init();
+bool scratch_init();
 void scratch_deinit();
-size_t aquire_scratch_handle();
-int scratch_handle_to_fd(size_t handle);
-void release_scratch_handle(size_t handle);
+uint8_t *scratch_extent(uint64_t extent_tag);
+void scratch_pread(void *bytes, size_t size, uint64_t offset);
+void scratch_preadv(size_t count, void *const *bytes, const size_t *sizes, const uint64_t *offsets);
+void scratch_pwrite(const void *bytes, size_t size, uint64_t offset);
+void scratch_pwritev(size_t count, const void *const *bytes, const size_t *sizes, const uint64_t *offsets);
+void scratch_punch(uint64_t offset, uint64_t size);
+uint8_t *scratch_buffer();
+int scratch_descriptor();
+const char *scratch_name();
+void scratch_sync();
+void scratch_clear();
 
 #endif
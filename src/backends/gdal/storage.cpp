@@ -28,86 +28,140 @@
 #include <cassert>
 #include <cstdint>
 #include <cstring>
+#include <cerrno>
 
 #include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 #include <unistd.h>
 
-#include <gdal.h>
-#include <cpl_vsi.h>
-
 #include <pthread.h>
 
-#include <set>
+#include <string>
+#include <vector>
 
 #include "constants.h"
 #include "storage.h"
 #include "lru.h"
 #include "extent.h"
 #include "scratch.h"
+#include "residency.h"
 #include "sync.h"
-#include "fullio.h"
-
-struct flush_queue_entry_t
-{
-    uint64_t tag;
-    bool should_remove;
+#include "readahead.h"
+#include "remote.h"
+#include "dedup.h"
+#include "metrics.h"
+#include "volume.h"
+#include "warm.h"
+#include "writeback.h"
 
-    bool operator<(const flush_queue_entry_t &rhs) const
-    {
-        return (should_remove > rhs.should_remove) || (tag > rhs.tag);
-    }
-};
+static uint64_t fetch_window = FETCH_DEFAULT_PAGES * PAGE_SIZE;
+static uint64_t dirty_idle_ns = DIRTY_IDLE_DEFAULT_CENTISECS * 10000000;
+static uint64_t dirty_expire_ns = DIRTY_EXPIRE_DEFAULT_CENTISECS * 10000000;
+static uint64_t dirty_soft_bytes = UINT64_MAX;
+static uint64_t dirty_hard_bytes = UINT64_MAX;
 
-typedef std::set<flush_queue_entry_t> flush_queue_t;
+static metric_t &dedup_local_reuses = metric_register("dedup_local_reuses");
+static metric_t &storage_bytes_written = metric_register("bytes_written");
+static metric_t &storage_bytes_uploaded = metric_register("remote_bytes_stored");
+static metric_t &storage_throttled_writes = metric_register("throttled_writes");
+static metric_t &storage_blocked_writes = metric_register("blocked_writes");
+static metric_t &storage_throttle_ns = metric_register("throttle_ns");
+static metric_t &storage_pinned_reads = metric_register("pinned_reads");
+static metric_t &storage_pinned_writes = metric_register("pinned_writes");
+static metric_t &storage_syncs = metric_register("syncs");
+static metric_t &storage_sync_epochs = metric_register("sync_epochs");
 
-static flush_queue_t *flush_queue = nullptr;
-static pthread_mutex_t flush_queue_lock = PTHREAD_MUTEX_INITIALIZER;
-static const char *blockdir = nullptr;
+// Syncs are grouped into epochs.  At most one epoch is committing at a
+// time; syncs that arrive meanwhile join the next one, and whichever
+// of them gets there first commits it for all of them.
+static pthread_mutex_t sync_epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_epoch_cond = PTHREAD_COND_INITIALIZER; // Signalled when an epoch has been committed
+static uint64_t sync_epoch_next = 1;
+static uint64_t sync_epoch_done = 0;
+static bool sync_epoch_committing = false;
 
 void *eviction_queue(void *arg);
 void *continuous_queue(void *arg);
 void *unqueue(void *arg);
+bool storage_prefetch(uint64_t extent_tag);
 
 /**
- * Initialize the flush queue.
+ * Initialize storage.
+ *
+ * @param _blockdir A pointer to a string giving the path to the storage directory
+ * @return 1 on success, 0 if the geometry of the volume cannot be determined or the scratch file (or persistent cache) cannot be used
  */
-void queue_init()
+extern "C" int storage_init(const char *_blockdir)
 {
-    if (flush_queue == nullptr)
+    uint64_t fetch_pages = FETCH_DEFAULT_PAGES;
+    const char *str;
+
+    // Everything else depends on the extent size (and a persistent
+    // cache on being able to record which volume it holds)
+    if (!warm_usable(_blockdir) || !volume_init(_blockdir))
     {
-        flush_queue = new flush_queue_t{};
+        return 0;
     }
-}
 
-/**
- * Deinitialize the flush queue.
- */
-void queue_deinit()
-{
-    pthread_mutex_lock(&flush_queue_lock);
-    if (flush_queue != nullptr)
+    // Nor can anything be cached without the scratch file
+    if (!scratch_init())
     {
-        delete flush_queue;
-        flush_queue = nullptr;
+        volume_deinit();
+        return 0;
     }
-    flush_queue_lock = PTHREAD_MUTEX_INITIALIZER;
-}
 
-/**
- * Initialize storage.
- *
- * @param _blockdir A pointer to a string giving the path to the storage directory
- */
-void storage_init(const char *_blockdir)
-{
-    blockdir = _blockdir;
-    queue_init();
+    // Fetch windows are a power-of-two number of pages, at most an extent
+    if ((str = getenv(S3BD_FETCH_PAGES)) != nullptr)
+    {
+        sscanf(str, "%lu", &fetch_pages);
+    }
+    fetch_pages = std::max(std::min(fetch_pages, PAGES_PER_EXTENT), static_cast<uint64_t>(1));
+    while ((fetch_pages & (fetch_pages - 1)) != 0)
+    {
+        fetch_pages &= (fetch_pages - 1);
+    }
+    fetch_window = fetch_pages * PAGE_SIZE;
+
+    // Dirty extents are written back once they have been idle for a
+    // while, or once they have been dirty for long enough
+    uint64_t idle_centisecs = DIRTY_IDLE_DEFAULT_CENTISECS;
+    uint64_t expire_centisecs = DIRTY_EXPIRE_DEFAULT_CENTISECS;
+    if ((str = getenv(S3BD_DIRTY_IDLE_CENTISECS)) != nullptr)
+    {
+        sscanf(str, "%lu", &idle_centisecs);
+    }
+    if ((str = getenv(S3BD_DIRTY_EXPIRE_CENTISECS)) != nullptr)
+    {
+        sscanf(str, "%lu", &expire_centisecs);
+    }
+    dirty_idle_ns = idle_centisecs * 10000000;
+    dirty_expire_ns = expire_centisecs * 10000000;
+
+    remote_init(_blockdir);
+    writeback_init();
     extent_init();
-    scratch_init();
+    residency_init();
     lru_init(eviction_queue);
+
+    // Writers are held back once the dirty data reaches some fraction
+    // of the local cache, and stopped once it reaches a larger one
+    uint64_t background_ratio = DIRTY_BACKGROUND_DEFAULT_RATIO;
+    uint64_t ratio = DIRTY_DEFAULT_RATIO;
+    if ((str = getenv(S3BD_DIRTY_BACKGROUND_RATIO)) != nullptr)
+    {
+        sscanf(str, "%lu", &background_ratio);
+    }
+    if ((str = getenv(S3BD_DIRTY_RATIO)) != nullptr)
+    {
+        sscanf(str, "%lu", &ratio);
+    }
+    dirty_soft_bytes = std::max((lru_capacity() * background_ratio) / 100, static_cast<uint64_t>(1)) * EXTENT_SIZE;
+    dirty_hard_bytes = std::max((lru_capacity() * ratio) / 100 * EXTENT_SIZE, dirty_soft_bytes + EXTENT_SIZE);
+
     sync_init(continuous_queue, unqueue);
+    warm_init(_blockdir);
+    readahead_init(storage_prefetch);
+
+    return 1;
 }
 
 /**
@@ -115,91 +169,188 @@ void storage_init(const char *_blockdir)
  */
 void storage_deinit()
 {
+    readahead_deinit();
+    writeback_stop();
     sync_deinit();
+    warm_deinit(storage_flush);
     lru_deinit();
+    residency_deinit();
     scratch_deinit();
     extent_deinit();
-    queue_deinit();
-    blockdir = nullptr;
+    writeback_deinit();
+    remote_deinit();
+    volume_deinit();
 }
 
 /**
- * Bring an extent in from storage to the scratch file.  The caller is
- * assumed to already have a write lock on the extent.
+ * Read the value of a named counter.  Besides the counters, there is
+ * "upload_amplification_percent": the bytes uploaded to remote
+ * storage as a percentage of the bytes written to the device.
  *
- * @param extent_tag The extent to read
- * @param page_tag The page to seek to
- * @param fd The file descriptor to use
- * @return A boolean indicating whether the extent is now present
+ * @param name The name of the counter
+ * @param value The return pointer
+ * @return 1 if the counter exists, 0 otherwise
  */
-bool storage_unflush(uint64_t extent_tag, uint64_t page_tag, int fd)
+extern "C" int storage_metric(const char *name, uint64_t *value)
 {
-    assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
-
-    // The extent should be either completely absent, or completely
-    // present.  If a hole is found in the extent, then assume it to
-    // be completely absent and replace it entirely.
-    if (lseek(fd, extent_tag, SEEK_HOLE) < static_cast<off_t>(extent_tag + EXTENT_SIZE))
+    if (strcmp(name, "upload_amplification_percent") == 0)
     {
-        char filename[0x100];
-        uint8_t *extent_array = new uint8_t[EXTENT_SIZE];
-        VSILFILE *handle = NULL;
+        uint64_t written = storage_bytes_written;
+        *value = (written > 0) ? (storage_bytes_uploaded * 100) / written : 0;
+        return 1;
+    }
+    return metric_value(name, value) ? 1 : 0;
+}
 
-        memset(extent_array, 0x33, EXTENT_SIZE);
+/**
+ * Read ranges of an extent.  If the extent is stored by content and
+ * an extent with the same content is clean and completely present in
+ * the scratch file, the ranges are copied from there; otherwise they
+ * are fetched from remote storage together.  The caller is assumed to
+ * already have a write lock on the extent.
+ *
+ * @param extent_tag The tag of the extent
+ * @param count The number of ranges
+ * @param offsets The offsets of the ranges within the extent
+ * @param sizes The sizes of the ranges
+ * @param bytes The arrays in which to return the bytes of each range
+ * @return A boolean indicating success or failure
+ */
+static bool storage_fetch(uint64_t extent_tag, size_t count, const uint64_t *offsets, const uint64_t *sizes, uint8_t **bytes)
+{
+    std::string hash;
+    uint64_t source;
 
-        // If possible, read the extent from remote storage
-        sprintf(filename, EXTENT_TEMPLATE, blockdir, extent_tag);
-        if ((handle = VSIFOpenL(filename, "r")) != NULL)
+    // The lock on the other extent is only tried, never waited for, so
+    // that two extents fetching from each other cannot deadlock
+    if (remote_hash(extent_tag, &hash) &&
+        dedup_local_find(hash, &source) &&
+        source != extent_tag &&
+        extent_lock(source, false, false))
+    {
+        bool reusable = (extent_clean(source) && residency_next_hole(source) >= source + EXTENT_SIZE);
+        if (reusable)
         {
-            for (unsigned int i = 0; i < PAGES_PER_EXTENT; ++i)
+            std::vector<uint64_t> sources(offsets, offsets + count);
+            for (auto &offset : sources)
             {
-                off_t offset = (i * PAGE_SIZE);
-                if (VSIFReadL(extent_array + offset, PAGE_SIZE, 1, handle) != 1)
-                {
-                    free(extent_array);
-                    VSIFCloseL(handle);
-                    return false;
-                }
+                offset += source;
             }
-            VSIFCloseL(handle);
+            scratch_preadv(count, reinterpret_cast<void *const *>(bytes), sizes, sources.data());
+            dedup_local_reuses++;
         }
-
-        // Attempt to write the bytes into the scratch file
-        if (lseek(fd, extent_tag, SEEK_SET) == static_cast<off_t>(extent_tag))
+        extent_unlock(source, false, false);
+        if (reusable)
         {
-            fullwrite(fd, extent_array, EXTENT_SIZE);
+            return true;
         }
-        else
+    }
+
+    return remote_fetch_ranges(extent_tag, count, offsets, sizes, bytes);
+}
+
+/**
+ * Bring the missing pages of parts of an extent in from storage to
+ * the scratch file.  Pages that are already present in the scratch
+ * file are left alone (they may be dirty).  The missing parts are
+ * fetched together.  The caller is assumed to already have a write
+ * lock on the extent.
+ *
+ * @param extent_tag The extent to read
+ * @param count The number of ranges
+ * @param begins The offsets of the first pages of the ranges
+ * @param ends The offsets just past the last pages of the ranges
+ * @return A boolean indicating whether the ranges are now present
+ */
+static bool storage_unflush(uint64_t extent_tag, size_t count, const uint64_t *begins, const uint64_t *ends)
+{
+    std::vector<uint64_t> offsets, sizes;
+    std::vector<uint8_t *> range_arrays;
+    bool ok = true;
+
+    // Only the part of each range from its first hole onward is needed
+    for (size_t i = 0; i < count; ++i)
+    {
+        assert(begins[i] == (begins[i] & (~PAGE_MASK)) && ends[i] == (ends[i] & (~PAGE_MASK)));
+        assert(extent_tag <= begins[i] && begins[i] < ends[i] && ends[i] <= extent_tag + EXTENT_SIZE);
+
+        uint64_t hole = residency_next_hole(begins[i]);
+        if (hole < ends[i])
         {
-            free(extent_array);
-            return false;
+            offsets.push_back(hole - extent_tag);
+            sizes.push_back(ends[i] - hole);
+            range_arrays.push_back(new uint8_t[ends[i] - hole]);
         }
-
-        // Bytes written to scratch file, so free resources and try to
-        // seek to the original offset
-        free(extent_array);
-        return (lseek(fd, page_tag, SEEK_DATA) == static_cast<off_t>(page_tag));
     }
-    else
+    if (offsets.empty())
     {
-        // Nothing to do, so free resources and report success
         return true;
     }
+
+    // Read those parts of the ranges from storage
+    ok = storage_fetch(extent_tag, offsets.size(), offsets.data(), sizes.data(), range_arrays.data());
+
+    // Write the bytes into the holes in the scratch file, all at once
+    std::vector<const void *> hole_arrays;
+    std::vector<uint64_t> hole_sizes, hole_offsets;
+    for (size_t i = 0; ok && i < offsets.size(); ++i)
+    {
+        uint64_t first = extent_tag + offsets[i];
+        uint64_t end = first + sizes[i];
+
+        for (uint64_t hole = first; hole < end;)
+        {
+            uint64_t data = std::min(residency_next_data(hole), end);
+            hole_arrays.push_back(range_arrays[i] + (hole - first));
+            hole_sizes.push_back(data - hole);
+            hole_offsets.push_back(hole);
+            hole = (data < end) ? residency_next_hole(data) : end;
+        }
+    }
+    scratch_pwritev(hole_arrays.size(), hole_arrays.data(), hole_sizes.data(), hole_offsets.data());
+    for (size_t i = 0; ok && i < offsets.size(); ++i)
+    {
+        residency_mark(extent_tag + offsets[i], extent_tag + offsets[i] + sizes[i]);
+    }
+    for (auto range_array : range_arrays)
+    {
+        delete[] range_array;
+    }
+
+    // A clean extent that is now complete can stand in for others with
+    // the same content
+    std::string hash;
+    if (ok &&
+        residency_next_hole(extent_tag) >= extent_tag + EXTENT_SIZE &&
+        extent_clean(extent_tag) &&
+        remote_hash(extent_tag, &hash))
+    {
+        dedup_local_insert(extent_tag, hash);
+    }
+
+    return ok;
 }
 
 /**
- * Flush an extent to storage from the scratch file.
+ * Flush an extent to storage from the scratch file.  Pages missing
+ * from the scratch file are filled in from storage so that a complete
+ * extent is always written.
  *
  * @param page_tag The tag whose entire extent should be flushed
  * @param should_remove Whether or not to remove the extent from the local cache
  * @return Boolean indicating success or failure
  */
-bool storage_flush(uint64_t extent_tag, bool should_remove = false)
+bool storage_flush(uint64_t extent_tag, bool should_remove)
 {
     assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
 
-    // Aquire a write lock on the extent
-    extent_spinlock(extent_tag, true);
+    // Aquire a write lock on the extent (flushing does not dirty it)
+    extent_lock_wait(extent_tag, true, false);
+
+    if (should_remove)
+    {
+        readahead_evicted(extent_tag);
+    }
 
     // If the extent is clean, leave quickly (possibly punching a hole
     // in the file on the way out, if needed)
@@ -207,165 +358,347 @@ bool storage_flush(uint64_t extent_tag, bool should_remove = false)
     {
         if (should_remove)
         {
-            auto scratch_handle = aquire_scratch_handle();
-            fallocate(
-                scratch_handle_to_fd(scratch_handle),
-                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-                extent_tag,
-                EXTENT_SIZE);
-            release_scratch_handle(scratch_handle);
+            dedup_local_forget(extent_tag);
+            residency_clear(extent_tag);
+            scratch_punch(extent_tag, EXTENT_SIZE);
         }
         extent_unlock(extent_tag, true, true);
         return true;
     }
 
-    // Aquire memory
-    uint8_t *extent_array = new uint8_t[EXTENT_SIZE];
+    uint64_t extent_end = extent_tag + EXTENT_SIZE;
+    uint8_t *extent_array = nullptr;
+    uint8_t *extent_heap = nullptr;
+    const uint8_t *extent = nullptr;
 
-    // Read the extent from the scratch file into the array
-    auto scratch_handle = aquire_scratch_handle();
-    int fd = scratch_handle_to_fd(scratch_handle);
-    if (lseek(fd, extent_tag, SEEK_DATA) != static_cast<off_t>(extent_tag))
+    // If the extent is completely present in a mapped scratch file,
+    // it can be written to storage straight from the mapping
+    if (residency_next_hole(extent_tag) >= extent_end)
     {
-        extent_unlock(extent_tag, true, true);
-        delete extent_array;
-        release_scratch_handle(scratch_handle);
-        return false;
+        extent = scratch_extent(extent_tag);
     }
-    fullread(fd, extent_array, EXTENT_SIZE);
-    release_scratch_handle(scratch_handle);
 
-    // Open extent file for writing
-    char filename[0x100];
-    VSILFILE *handle = NULL;
-    sprintf(filename, EXTENT_TEMPLATE, blockdir, extent_tag);
-    if ((handle = VSIFOpenL(filename, "w")) == NULL)
+    if (extent == nullptr)
     {
-        delete extent_array;
-        extent_unlock(extent_tag, true, false);
-        return false;
-    }
-
-    // Copy all pages from extent_array
-    for (unsigned int i = 0; i < PAGES_PER_EXTENT; ++i)
-    {
-        uint64_t offset = i * PAGE_SIZE;
+        // Aquire memory (the scratch file's own buffer if it has one)
+        if ((extent_array = scratch_buffer()) == nullptr)
+        {
+            extent_array = extent_heap = new uint8_t[EXTENT_SIZE];
+        }
 
-        // Write into extent file
-        if (VSIFWriteL(extent_array + offset, PAGE_SIZE, 1, handle) != 1)
+        // If the extent is not completely present in the scratch file,
+        // start from the stored version of it
+        uint64_t offset = 0, size = EXTENT_SIZE;
+        if (residency_next_hole(extent_tag) < extent_end &&
+            !storage_fetch(extent_tag, 1, &offset, &size, &extent_array))
         {
-            VSIFCloseL(handle);
-            delete extent_array;
+            delete[] extent_heap;
             extent_unlock(extent_tag, true, false);
             return false;
         }
+
+        // Overlay the pages that are present in the scratch file
+        std::vector<void *> data_arrays;
+        std::vector<uint64_t> data_sizes, data_offsets;
+        for (uint64_t data = residency_next_data(extent_tag); data < extent_end;)
+        {
+            uint64_t hole = std::min(residency_next_hole(data), extent_end);
+            data_arrays.push_back(extent_array + (data - extent_tag));
+            data_sizes.push_back(hole - data);
+            data_offsets.push_back(data);
+            data = (hole < extent_end) ? residency_next_data(hole) : extent_end;
+        }
+        scratch_preadv(data_arrays.size(), data_arrays.data(), data_sizes.data(), data_offsets.data());
+        extent = extent_array;
     }
 
-    if (should_remove)
+    // Write the extent to storage
+    if (!remote_store(extent_tag, extent))
+    {
+        delete[] extent_heap;
+        extent_unlock(extent_tag, true, false);
+        return false;
+    }
+
+    // Punch hole if the extent is leaving the cache, or if it is all
+    // zeros, in which case it can be read without the scratch file
+    std::string hash;
+    if (should_remove || remote_zero(extent_tag))
     {
-        // Punch hole
-        auto scratch_handle = aquire_scratch_handle();
-        fallocate(
-            scratch_handle_to_fd(scratch_handle),
-            FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-            extent_tag,
-            EXTENT_SIZE);
-        release_scratch_handle(scratch_handle);
+        dedup_local_forget(extent_tag);
+        residency_clear(extent_tag);
+        scratch_punch(extent_tag, EXTENT_SIZE);
+    }
+    else if (residency_next_hole(extent_tag) >= extent_end && remote_hash(extent_tag, &hash))
+    {
+        dedup_local_insert(extent_tag, hash);
     }
 
-    // Close extent file, release locks, delete array
-    VSIFFlushL(handle);
-    VSIFCloseL(handle);
-    delete extent_array;
+    // Release locks, delete array
+    delete[] extent_heap;
     extent_unlock(extent_tag, true, true);
 
     return true;
 }
 
 /**
- * Attempt to read and return a page or less of data.
+ * Bring an extent into the scratch file ahead of demand.  The extent
+ * is not marked dirty by this.
  *
- * @param page_tag The tag of the page to read from
- * @param size The number of bytes to read (must be <= the size of a page)
+ * @param extent_tag The extent to fetch
+ * @return A boolean indicating whether the extent had to be fetched
+ */
+bool storage_prefetch(uint64_t extent_tag)
+{
+    assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
+
+    bool fetched = false;
+
+    // Note that the extent has been touched so that it is eventually evicted
+    lru_report_extent(extent_tag);
+
+    // Acquire resources
+    extent_lock_wait(extent_tag, true, false);
+
+    // Fetch the extent if any of it is missing (and not known without
+    // fetching it)
+    uint8_t fill;
+    if (residency_next_hole(extent_tag) < extent_tag + EXTENT_SIZE && !remote_synthetic(extent_tag, &fill))
+    {
+        uint64_t extent_end = extent_tag + EXTENT_SIZE;
+        fetched = storage_unflush(extent_tag, 1, &extent_tag, &extent_end);
+    }
+
+    // Release resources
+    extent_unlock(extent_tag, true, false);
+
+    return fetched;
+}
+
+/**
+ * Make sure that the pages of part of an extent are present in the
+ * scratch file, fetching whole aligned windows around any that are
+ * missing.  The windows are fetched together, so that a span with
+ * several holes costs one request.  The caller is assumed to already
+ * have a write lock on the extent.
+ *
+ * @param extent_tag The extent
+ * @param begin The offset of the first page
+ * @param end The offset just past the last page
+ * @return A boolean indicating whether the pages are now present
+ */
+static bool storage_make_present(uint64_t extent_tag, uint64_t begin, uint64_t end)
+{
+    std::vector<uint64_t> window_begins, window_ends;
+
+    for (uint64_t hole = residency_next_hole(begin); hole < end;)
+    {
+        uint64_t data = std::min(residency_next_data(hole), end);
+        uint64_t window_begin = hole & (~(fetch_window - 1));
+        uint64_t window_end = (data + fetch_window - 1) & (~(fetch_window - 1));
+
+        // An encoded extent has to be fetched whole anyway
+        if (remote_encoded(extent_tag))
+        {
+            window_begin = extent_tag;
+            window_end = extent_tag + EXTENT_SIZE;
+        }
+
+        // Adjacent windows are merged
+        if (!window_ends.empty() && window_ends.back() == window_begin)
+        {
+            window_ends.back() = window_end;
+        }
+        else
+        {
+            window_begins.push_back(window_begin);
+            window_ends.push_back(window_end);
+        }
+        hole = (window_end < end) ? residency_next_hole(window_end) : end;
+    }
+
+    return storage_unflush(extent_tag, window_begins.size(), window_begins.data(), window_ends.data());
+}
+
+/**
+ * Read a span of an extent whose stored contents are known without
+ * reading them (see remote_synthetic).  Pages that are present in the
+ * scratch file are read from it, and the rest are filled in.  The
+ * caller is assumed to already have a lock on the extent.
+ *
+ * @param offset The virtual block device offset to read from
+ * @param size The number of bytes to read
  * @param bytes The array in which to return the bytes
+ * @param fill The value of every stored byte of the extent
+ */
+static void storage_read_synthetic(uint64_t offset, size_t size, uint8_t *bytes, uint8_t fill)
+{
+    uint64_t end = offset + size;
+
+    for (uint64_t pos = offset; pos < end;)
+    {
+        uint64_t hole = residency_next_hole(pos);
+        uint64_t next;
+
+        if (hole <= pos)
+        {
+            next = std::min(residency_next_data(pos), end);
+            memset(bytes + (pos - offset), fill, next - pos);
+        }
+        else
+        {
+            next = std::min(hole, end);
+            scratch_pread(bytes + (pos - offset), next - pos, pos);
+        }
+        pos = next;
+    }
+}
+
+/**
+ * Read a span of bytes that lies within a single extent.  The extent
+ * is reported once, and the bytes are read from the scratch file in
+ * one operation.  If the span is already present in the scratch file,
+ * only a read lock is taken, so any number of readers can proceed at
+ * once; the same is true of an extent that is stored as all zeros or
+ * not stored at all, whose missing pages are filled in.  Otherwise
+ * the missing pages are fetched under a write lock.  Either way, the extent is not marked
+ * dirty.
+ *
+ * @param offset The virtual block device offset to read from
+ * @param size The number of bytes to read
+ * @param bytes The array in which to return the bytes
+ * @param should_report Whether to report the extent as having been touched
  * @return Boolean indicating success or failure
  */
-bool aligned_page_read(uint64_t page_tag, uint16_t size, uint8_t *bytes, bool should_report)
+static bool storage_read_span(uint64_t offset, size_t size, uint8_t *bytes, bool should_report)
 {
-    assert(page_tag == (page_tag & (~PAGE_MASK))); // Assert alignment
+    uint8_t fill;
+    uint64_t extent_tag = offset & (~EXTENT_MASK);
+    uint64_t begin = offset & (~PAGE_MASK);
+    uint64_t end = (offset + size + PAGE_MASK) & (~PAGE_MASK);
 
-    uint64_t extent_tag = page_tag & (~EXTENT_MASK);
+    assert(((offset + size - 1) & (~EXTENT_MASK)) == extent_tag);
 
-    // Note that the page has been touched
+    // Note that the extent has been touched
     if (should_report)
     {
         lru_report_extent(extent_tag);
     }
 
-    // Acquire resources
-    extent_spinlock(extent_tag, true);
-    auto scratch_handle = aquire_scratch_handle();
-    int fd = scratch_handle_to_fd(scratch_handle);
+    // Fast path: the span is already present, or the rest of the
+    // extent is known without fetching it
+    extent_lock_wait(extent_tag, false);
+    if (residency_next_hole(begin) >= end)
+    {
+        scratch_pread(bytes, size, offset);
+        extent_unlock(extent_tag, false, false);
+        return true;
+    }
+    else if (remote_synthetic(extent_tag, &fill))
+    {
+        storage_read_synthetic(offset, size, bytes, fill);
+        extent_unlock(extent_tag, false, false);
+        return true;
+    }
+    extent_unlock(extent_tag, false, false);
 
-    // Read the bytes
-    if ((lseek(fd, page_tag, SEEK_DATA) == static_cast<off_t>(page_tag)) ||
-        storage_unflush(extent_tag, page_tag, fd))
+    // Slow path: fetch the missing pages under a write lock that does
+    // not dirty the extent, then read under a read lock
+    extent_lock_wait(extent_tag, true, false);
+    if (storage_make_present(extent_tag, begin, end))
     {
-        extent_lock_downgrade(extent_tag); // ?
-        fullread(fd, bytes, size);
-        release_scratch_handle(scratch_handle);
+        extent_lock_downgrade(extent_tag);
+        scratch_pread(bytes, size, offset);
         extent_unlock(extent_tag, false, false);
         return true;
     }
     else
     {
-        release_scratch_handle(scratch_handle);
         extent_unlock(extent_tag, true, false);
         return false;
     }
 }
 
 /**
- * Attempt to write a whole page of data.
+ * Write a span of bytes that lies within a single extent.  Only pages
+ * that are partially overwritten need to be present beforehand; the
+ * bytes are written to the scratch file in one operation.
  *
- * @param page_tag The tag of the page to write from
- * @param size The number of bytes to write (must be <= the size of a page)
+ * @param offset The virtual block device offset to write to
+ * @param size The number of bytes to write
  * @param bytes The array from which to write the bytes
  * @return Boolean indicating success or failure
  */
-bool aligned_whole_page_write(uint64_t page_tag, const uint8_t *bytes)
+static bool storage_write_span(uint64_t offset, size_t size, const uint8_t *bytes)
 {
-    assert(page_tag == (page_tag & (~PAGE_MASK))); // Assert alignment
+    uint64_t extent_tag = offset & (~EXTENT_MASK);
+    uint64_t first_page_tag = offset & (~PAGE_MASK);
+    uint64_t last_page_tag = (offset + size - 1) & (~PAGE_MASK);
+    bool ok = true;
 
-    uint64_t extent_tag = page_tag & (~EXTENT_MASK);
+    assert(((offset + size - 1) & (~EXTENT_MASK)) == extent_tag);
 
-    // Note that the page has been touched
+    // Note that the extent has been touched
     lru_report_extent(extent_tag);
 
     // Acquire resources
-    extent_spinlock(extent_tag, true);
-    auto scratch_handle = aquire_scratch_handle();
-    int fd = scratch_handle_to_fd(scratch_handle);
+    extent_lock_wait(extent_tag, true);
 
-    // Write the bytes
-    if ((lseek(fd, page_tag, SEEK_DATA) == static_cast<off_t>(page_tag)) ||
-        storage_unflush(extent_tag, page_tag, fd))
+    // Bring in partially-overwritten pages at either end of the span
+    if (offset != first_page_tag || (size < PAGE_SIZE))
     {
-        fullwrite(fd, bytes, PAGE_SIZE);
-        release_scratch_handle(scratch_handle);
-        extent_unlock(extent_tag, true, false);
-        return true;
+        ok = ok && storage_make_present(extent_tag, first_page_tag, first_page_tag + PAGE_SIZE);
     }
-    else
+    if (((offset + size) & PAGE_MASK) != 0 && last_page_tag != first_page_tag)
     {
-        release_scratch_handle(scratch_handle);
-        extent_unlock(extent_tag, true, false);
-        return false;
+        ok = ok && storage_make_present(extent_tag, last_page_tag, last_page_tag + PAGE_SIZE);
+    }
+
+    // Write the bytes
+    if (ok)
+    {
+        scratch_pwrite(bytes, size, offset);
+        residency_mark(first_page_tag, last_page_tag + PAGE_SIZE);
+        dedup_local_forget(extent_tag);
+        storage_bytes_written += size;
     }
+    extent_unlock(extent_tag, true, false);
+    return ok;
 }
 
 /**
- * Read bytes from storage.
+ * Attempt to read and return a page or less of data.
+ *
+ * @param page_tag The tag of the page to read from
+ * @param size The number of bytes to read (must be <= the size of a page)
+ * @param bytes The array in which to return the bytes
+ * @return Boolean indicating success or failure
+ */
+bool aligned_page_read(uint64_t page_tag, uint16_t size, uint8_t *bytes, bool should_report)
+{
+    assert(page_tag == (page_tag & (~PAGE_MASK))); // Assert alignment
+    assert(size <= PAGE_SIZE);
+
+    return storage_read_span(page_tag, size, bytes, should_report);
+}
+
+/**
+ * Attempt to write a whole page of data.
+ *
+ * @param page_tag The tag of the page to write from
+ * @param bytes The array from which to write the bytes
+ * @return Boolean indicating success or failure
+ */
+bool aligned_whole_page_write(uint64_t page_tag, const uint8_t *bytes)
+{
+    assert(page_tag == (page_tag & (~PAGE_MASK))); // Assert alignment
+
+    return storage_write_span(page_tag, PAGE_SIZE, bytes);
+}
+
+/**
+ * Read bytes from storage.  The request is split into spans that do
+ * not cross extent boundaries.
  *
  * @param offset The virtual block device offset to read from
  * @param size The number of bytes to read
@@ -374,49 +707,69 @@ bool aligned_whole_page_write(uint64_t page_tag, const uint8_t *bytes)
  */
 extern "C" int storage_read(off_t offset, size_t size, uint8_t *bytes)
 {
-    uint64_t page_tag = offset & (~PAGE_MASK);
+    int bytes_read = 0;
+
+    readahead_report(offset, size);
 
-    if (page_tag == static_cast<uint64_t>(offset)) // If aligned read ...
+    while (size > 0)
     {
-        int bytes_read = 0;
-        while (size > 0)
+        uint64_t extent_tag = offset & (~EXTENT_MASK);
+        auto size2 = std::min(size, static_cast<size_t>(extent_tag + EXTENT_SIZE - offset));
+
+        if (!storage_read_span(offset, size2, bytes, true))
         {
-            auto size2 = std::min(size, PAGE_SIZE);
-            if (aligned_page_read(page_tag, size2, bytes))
-            {
-                page_tag += size2;
-                size -= size2;
-                bytes += size2;
-                bytes_read += size2;
-            }
-            else
-            {
-                break;
-            }
+            break;
         }
-        return bytes_read;
+        offset += size2;
+        size -= size2;
+        bytes += size2;
+        bytes_read += size2;
     }
-    else // If unaligned read ...
+    return (bytes_read > 0 || size == 0) ? bytes_read : -EIO;
+}
+
+/**
+ * Hold a writer back while there is too much dirty data.  Above the
+ * soft limit the writer sleeps for a time proportional to the excess
+ * (or until the dirty data drops back below the limit); at the hard
+ * limit it waits for writeback to catch up.  Either way, the
+ * background writeback is told to stop waiting for extents to become
+ * due.
+ */
+static void storage_throttle()
+{
+    uint64_t dirty = extent_dirty_total();
+
+    if (dirty <= dirty_soft_bytes)
     {
-        auto diff = offset - page_tag;
-        auto size2 = std::min(size, PAGE_SIZE - diff);
-        uint8_t page[PAGE_SIZE];
+        return;
+    }
 
-        aligned_page_read(page_tag, PAGE_SIZE, page);
-        memcpy(bytes, page + diff, size2);
-        if (size2 == size)
-        {
-            return size;
-        }
-        else
+    uint64_t start = extent_now_ns();
+
+    writeback_kick();
+    if (dirty < dirty_hard_bytes)
+    {
+        uint64_t delay_ns = (DIRTY_THROTTLE_MAX_MILLISECS * 1000000 * (dirty - dirty_soft_bytes)) / (dirty_hard_bytes - dirty_soft_bytes);
+
+        storage_throttled_writes++;
+        extent_dirty_wait(dirty_soft_bytes, delay_ns);
+    }
+    else
+    {
+        storage_blocked_writes++;
+        while (!extent_dirty_wait(dirty_hard_bytes, DIRTY_THROTTLE_MAX_MILLISECS * 1000000))
         {
-            return size2 + storage_read(page_tag + PAGE_SIZE, size - size2, bytes + size2);
+            writeback_kick();
         }
     }
+
+    storage_throttle_ns += extent_now_ns() - start;
 }
 
 /**
- * Write bytes to storage.
+ * Write bytes to storage.  The request is split into spans that do
+ * not cross extent boundaries.
  *
  * @param offset The virtual block device offset to write to
  * @param size The number of bytes to write
@@ -425,63 +778,211 @@ extern "C" int storage_read(off_t offset, size_t size, uint8_t *bytes)
  */
 extern "C" int storage_write(off_t offset, size_t size, const uint8_t *bytes)
 {
-    uint64_t page_tag = offset & (~PAGE_MASK);
+    int bytes_written = 0;
 
-    if (page_tag == static_cast<uint64_t>(offset) && (size % PAGE_SIZE == 0)) // If writing a complete page ...
+    storage_throttle();
+    while (size > 0)
     {
-        int bytes_written = 0;
-        while (size > 0)
+        uint64_t extent_tag = offset & (~EXTENT_MASK);
+        auto size2 = std::min(size, static_cast<size_t>(extent_tag + EXTENT_SIZE - offset));
+
+        if (!storage_write_span(offset, size2, bytes))
         {
-            if (aligned_whole_page_write(page_tag, bytes))
-            {
-                page_tag += PAGE_SIZE;
-                size -= PAGE_SIZE;
-                bytes += PAGE_SIZE;
-                bytes_written += PAGE_SIZE;
-            }
-            else
-            {
-                break;
-            }
+            break;
         }
-        return bytes_written;
+        offset += size2;
+        size -= size2;
+        bytes += size2;
+        bytes_written += size2;
+    }
+    return (bytes_written > 0 || size == 0) ? bytes_written : -EIO;
+}
+
+/**
+ * Pin a span of the device that is present in the scratch file, so
+ * that it can be read straight from the scratch file (for example,
+ * spliced into a reply) without being copied through a buffer.  The
+ * span is held under a read lock until storage_read_unpin.
+ *
+ * @param offset The virtual block device offset of the span
+ * @param size The size of the span
+ * @param fd The return pointer for the descriptor of the scratch file
+ * @param fd_offset The return pointer for the offset of the span in it
+ * @return 1 if the span is pinned, 0 if it must be read with storage_read
+ */
+extern "C" int storage_read_pin(off_t offset, size_t size, int *fd, off_t *fd_offset)
+{
+    uint64_t extent_tag = offset & (~EXTENT_MASK);
+    uint64_t begin = offset & (~PAGE_MASK);
+    uint64_t end = (offset + size + PAGE_MASK) & (~PAGE_MASK);
+
+    if (size == 0 || ((offset + size - 1) & (~EXTENT_MASK)) != extent_tag)
+    {
+        return 0;
     }
-    else // If writing an unaligned and/or incomplete page ...
+
+    extent_lock_wait(extent_tag, false);
+    if (residency_next_hole(begin) < end)
     {
-        auto diff = offset - page_tag;
-        auto size2 = std::min(size, PAGE_SIZE - diff);
-        uint8_t page[PAGE_SIZE] = {};
+        extent_unlock(extent_tag, false, false);
+        return 0;
+    }
 
-        aligned_page_read(page_tag, PAGE_SIZE, page); // read
-        memcpy(page + diff, bytes, size2);            // update
-        aligned_whole_page_write(page_tag, page);     // write
+    // Only count the read once it is certain to be done here
+    readahead_report(offset, size);
+    lru_report_extent(extent_tag);
+    storage_pinned_reads++;
 
-        if (size2 == size)
-        {
-            return size;
-        }
-        else
-        {
-            return size2 + storage_write(page_tag + PAGE_SIZE, size - size2, bytes + size2);
-        }
+    *fd = scratch_descriptor();
+    *fd_offset = offset;
+    return 1;
+}
+
+/**
+ * Release a span pinned by storage_read_pin.
+ *
+ * @param offset The virtual block device offset of the span
+ */
+extern "C" void storage_read_unpin(off_t offset)
+{
+    extent_unlock(offset & (~EXTENT_MASK), false, false);
+}
+
+/**
+ * Pin a span of the device for writing, so that the bytes can be
+ * written (for example, spliced) straight into the scratch file.  The
+ * span is held under a write lock until storage_write_unpin, which
+ * must be told whether all of it was written.
+ *
+ * @param offset The virtual block device offset of the span
+ * @param size The size of the span
+ * @param fd The return pointer for the descriptor of the scratch file
+ * @param fd_offset The return pointer for the offset of the span in it
+ * @return 1 if the span is pinned, 0 if it must be written with storage_write, -EIO on error
+ */
+extern "C" int storage_write_pin(off_t offset, size_t size, int *fd, off_t *fd_offset)
+{
+    uint64_t extent_tag = offset & (~EXTENT_MASK);
+    uint64_t first_page_tag = offset & (~PAGE_MASK);
+    uint64_t last_page_tag = (offset + size - 1) & (~PAGE_MASK);
+    bool ok = true;
+
+    if (size == 0 || ((offset + size - 1) & (~EXTENT_MASK)) != extent_tag)
+    {
+        return 0;
+    }
+
+    storage_throttle();
+    lru_report_extent(extent_tag);
+    extent_lock_wait(extent_tag, true);
+
+    // As in storage_write_span
+    if (static_cast<uint64_t>(offset) != first_page_tag || (size < PAGE_SIZE))
+    {
+        ok = ok && storage_make_present(extent_tag, first_page_tag, first_page_tag + PAGE_SIZE);
     }
+    if (((offset + size) & PAGE_MASK) != 0 && last_page_tag != first_page_tag)
+    {
+        ok = ok && storage_make_present(extent_tag, last_page_tag, last_page_tag + PAGE_SIZE);
+    }
+    if (!ok)
+    {
+        extent_unlock(extent_tag, true, false);
+        return -EIO;
+    }
+
+    *fd = scratch_descriptor();
+    *fd_offset = offset;
+    return 1;
 }
 
-// ------------------------------------------------------------------------
+/**
+ * Release a span pinned by storage_write_pin.  If it was not written
+ * in full, its contents are undefined (as after a failed write), but
+ * the pages around it are unharmed.
+ *
+ * @param offset The virtual block device offset of the span
+ * @param size The size of the span
+ * @param written True if the whole span was written
+ */
+extern "C" void storage_write_unpin(off_t offset, size_t size, int written)
+{
+    uint64_t extent_tag = offset & (~EXTENT_MASK);
+
+    if (written)
+    {
+        residency_mark(offset & (~PAGE_MASK), ((offset + size - 1) & (~PAGE_MASK)) + PAGE_SIZE);
+        dedup_local_forget(extent_tag);
+        storage_bytes_written += size;
+        storage_pinned_writes++;
+    }
+    extent_unlock(extent_tag, true, false);
+}
 
 /**
- * Insert an entry into the flush queue.
+ * Commit an epoch: write back every extent that is dirty now, all at
+ * once, and wait for them.
+ */
+static void storage_commit_epoch()
+{
+    std::vector<uint64_t> extent_tags;
+
+    storage_sync_epochs++;
+    extent_dirty_since(&extent_tags, extent_now_ns());
+    for (auto extent_tag : extent_tags)
+    {
+        writeback_request(extent_tag, WRITEBACK_SYNC, false);
+    }
+    writeback_wait(extent_tags);
+}
+
+/**
+ * Make everything written before the call durable: wait until every
+ * extent dirtied before then has been uploaded.  Concurrent calls
+ * share the work (see storage_commit_epoch).
  *
- * @param extent_tag The tag of the extent in question
- * @param should_remove Whether the extent should be removed from the scratch file
+ * @return 0 on success, -EIO if some of the data could not be uploaded
  */
-inline void flush_queue_insert(uint64_t extent_tag, bool should_remove)
+extern "C" int storage_sync()
 {
-    pthread_mutex_lock(&flush_queue_lock);
-    flush_queue->insert(flush_queue_entry_t{extent_tag, should_remove});
-    pthread_mutex_unlock(&flush_queue_lock);
+    std::vector<uint64_t> extent_tags;
+    uint64_t start = extent_now_ns();
+    uint64_t epoch;
+
+    storage_syncs++;
+
+    pthread_mutex_lock(&sync_epoch_lock);
+    epoch = sync_epoch_next;
+    while (sync_epoch_done < epoch)
+    {
+        if (sync_epoch_committing)
+        {
+            pthread_cond_wait(&sync_epoch_cond, &sync_epoch_lock);
+        }
+        else
+        {
+            sync_epoch_committing = true;
+            sync_epoch_next = epoch + 1;
+            pthread_mutex_unlock(&sync_epoch_lock);
+
+            storage_commit_epoch();
+
+            pthread_mutex_lock(&sync_epoch_lock);
+            sync_epoch_committing = false;
+            sync_epoch_done = epoch;
+            pthread_cond_broadcast(&sync_epoch_cond);
+        }
+    }
+    pthread_mutex_unlock(&sync_epoch_lock);
+
+    // Whoever committed the epoch, anything still dirty from before the
+    // call could not be uploaded
+    extent_dirty_since(&extent_tags, start);
+    return extent_tags.empty() ? 0 : -EIO;
 }
 
+// ------------------------------------------------------------------------
+
 /**
  * Flush an evicted extent.
  *
@@ -492,62 +993,59 @@ void *eviction_queue(void *arg)
 {
     uint64_t tag = reinterpret_cast<uint64_t>(arg);
 
-    flush_queue_insert(tag, true);
+    writeback_request(tag, WRITEBACK_EVICTION, true);
     return nullptr;
 }
 
 /**
- * Continuously flush all dirty pages to storage.
+ * Periodically request writeback of the dirty extents that have
+ * become due.
  *
  * @param arg Unused
  * @return Always nullptr
  */
 void *continuous_queue(void *arg)
 {
-    while (sync_thread_continue)
-    {
-        uint64_t extent_tag;
+    std::vector<uint64_t> extent_tags;
 
-        if (extent_first_dirty_unreferenced(&extent_tag))
+    do
+    {
+        // Under pressure, every dirty extent is due
+        if (extent_dirty_total() > dirty_soft_bytes)
         {
-            flush_queue_insert(extent_tag, false);
+            extent_due(&extent_tags, 0, 0);
         }
         else
         {
-            sleep(1);
+            extent_due(&extent_tags, dirty_idle_ns, dirty_expire_ns);
         }
-    }
+        for (auto extent_tag : extent_tags)
+        {
+            writeback_request(extent_tag, WRITEBACK_BACKGROUND, false);
+        }
+    } while (writeback_sleep(WRITEBACK_INTERVAL_CENTISECS * 10000000));
+
     return nullptr;
 }
 
 /**
- * Unqueue extents: write them from the scratch file to storage.
+ * Unqueue extents: write them from the scratch file to storage.  Any
+ * number of these may run concurrently; the scheduler never hands the
+ * same extent to two of them at once.
  *
  * @param arg Unused
  * @return Always nullptr
  */
 void *unqueue(void *arg)
 {
-    while (sync_thread_continue)
+    uint64_t extent_tag;
+    bool should_remove;
+
+    while (writeback_next(&extent_tag, &should_remove))
     {
-        pthread_mutex_lock(&flush_queue_lock);
-        if (!flush_queue->empty())
-        {
-            auto itr = flush_queue->cbegin();
-            auto tag = itr->tag;
-            auto should_remove = itr->should_remove;
-#if 0
-            fprintf(stderr, "XXX size=%ld tag=%016lx should_remove=%s\n", flush_queue->size(), tag, should_remove ? "true" : "false");
-#endif
-            flush_queue->erase(itr);
-            pthread_mutex_unlock(&flush_queue_lock);
-            storage_flush(tag, should_remove);
-        }
-        else
-        {
-            pthread_mutex_unlock(&flush_queue_lock);
-            sleep(1);
-        }
+        storage_flush(extent_tag, should_remove);
+        writeback_done(extent_tag);
     }
+
     return nullptr;
 }
@@ -34,17 +34,23 @@ extern "C"
 {
 #endif
 
-    void storage_init(const char *_blockdir);
+    int storage_init(const char *_blockdir);
     void storage_deinit();
     int storage_read(off_t offset, size_t size, uint8_t *bytes);
     int storage_write(off_t offset, size_t size, const uint8_t *bytes);
+    int storage_sync();
+    int storage_read_pin(off_t offset, size_t size, int *fd, off_t *fd_offset);
+    void storage_read_unpin(off_t offset);
+    int storage_write_pin(off_t offset, size_t size, int *fd, off_t *fd_offset);
+    void storage_write_unpin(off_t offset, size_t size, int written);
+    int storage_metric(const char *name, uint64_t *value);
 
 #ifdef __cplusplus
 }
 
 bool aligned_page_read(uint64_t page_tag, uint16_t size, uint8_t *bytes, bool should_report = true);
 bool aligned_whole_page_write(uint64_t page_tag, const uint8_t *bytes);
-void *storage_flush(void *arg);
+bool storage_flush(uint64_t extent_tag, bool should_remove = false);
 
 #endif
 #endif
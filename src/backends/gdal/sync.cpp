@@ -28,31 +28,63 @@
 #include <unistd.h>
 #include <pthread.h>
 
+#include <vector>
+
 #include "constants.h"
 #include "sync.h"
 
 static pthread_t sync_thread;
-static pthread_t unqueue_thread;
-bool sync_thread_continue = false;
+static std::vector<pthread_t> *unqueue_threads = nullptr;
 
 /**
- * Initialize the syncing threads.
+ * Initialize the syncing threads.  One thread runs the first
+ * function, and a pool of flush workers (sized by the
+ * S3BD_FLUSH_WORKERS environment variable) run the second.
  *
- * @param size The maximuim number of cache entries.
+ * @param f The function that finds extents to flush
+ * @param g The function that flushes them
  */
 void sync_init(void *(*f)(void *), void *(*g)(void *))
 {
-    sync_thread_continue = true;
+    size_t flush_workers = FLUSH_WORKERS_DEFAULT;
+    const char *str;
+
+    if ((str = getenv(S3BD_FLUSH_WORKERS)) != nullptr)
+    {
+        sscanf(str, "%lu", &flush_workers);
+    }
+    if (flush_workers < 1)
+    {
+        flush_workers = 1;
+    }
+
     pthread_create(&sync_thread, NULL, f, nullptr);
-    pthread_create(&unqueue_thread, NULL, g, nullptr);
+    if (unqueue_threads == nullptr)
+    {
+        unqueue_threads = new std::vector<pthread_t>{};
+        for (size_t i = 0; i < flush_workers; ++i)
+        {
+            pthread_t unqueue_thread;
+            pthread_create(&unqueue_thread, NULL, g, nullptr);
+            unqueue_threads->push_back(unqueue_thread);
+        }
+    }
 }
 
 /**
- * Deinitialize the syncing threads.
+ * Deinitialize the syncing threads.  The functions they run must
+ * already have been told to return.
  */
 void sync_deinit()
 {
-    sync_thread_continue = false;
     pthread_join(sync_thread, nullptr);
-    pthread_join(unqueue_thread, nullptr);
+    if (unqueue_threads != nullptr)
+    {
+        for (auto unqueue_thread : *unqueue_threads)
+        {
+            pthread_join(unqueue_thread, nullptr);
+        }
+        delete unqueue_threads;
+        unqueue_threads = nullptr;
+    }
 }
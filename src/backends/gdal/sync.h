@@ -25,8 +25,6 @@
 #ifndef __SYNC_H__
 #define __SYNC_H__
 
-extern bool sync_thread_continue;
-
 void sync_init(void *(*f)(void *), void *(*g)(void *));
 void sync_deinit();
 
@@ -25,36 +25,95 @@
 #define BOOST_TEST_MODULE Storage Tests
 #include <boost/test/included/unit_test.hpp>
 
+#include <atomic>
+#include <string>
 #include <vector>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
 #include <gdal.h>
 #include <cpl_vsi.h>
 
 #include "constants.h"
 #include "storage.h"
+#include "extent.h"
+#include "residency.h"
+#include "scratch.h"
+#include "lru.h"
+#include "manifest.h"
+#include "writeback.h"
 
-constexpr uint64_t backed_extent_tag = 1 * EXTENT_SIZE;
-constexpr uint64_t unbacked_extent_tag = 0 * EXTENT_SIZE;
+const uint64_t backed_extent_tag = 1 * EXTENT_SIZE;
+const uint64_t unbacked_extent_tag = 0 * EXTENT_SIZE;
 
-void freshen_file()
+/**
+ * Unset the environment variables that change what a mount stores or
+ * caches, so that a test sees the defaults whatever environment the
+ * tests are run in.  (The scratch file access method is left alone:
+ * the tests are meant to pass with each of them.)
+ */
+void unset_environment()
+{
+    const char *names[] = {
+        S3BD_LOCAL_CACHE_MEGABYTES,
+        S3BD_FLUSH_WORKERS,
+        S3BD_READAHEAD_EXTENTS,
+        S3BD_FETCH_PAGES,
+        S3BD_EVICTION_POLICY,
+        S3BD_COMPRESSION,
+        S3BD_DEDUP,
+        S3BD_DEDUP_DIR,
+        S3BD_NO_MANIFEST,
+        S3BD_EXTENT_KILOBYTES,
+        S3BD_PERSISTENT_CACHE,
+        S3BD_DIRTY_IDLE_CENTISECS,
+        S3BD_DIRTY_EXPIRE_CENTISECS,
+        S3BD_DIRTY_BACKGROUND_RATIO,
+        S3BD_DIRTY_RATIO};
+
+    for (auto name : names)
+    {
+        unsetenv(name);
+    }
+}
+
+void freshen_extent(const char *blockdir, uint64_t extent_tag)
 {
     uint8_t *extent;
     char filename[0x100];
 
-    // Create a file to work with
-    sprintf(filename, EXTENT_TEMPLATE, "/vsimem", backed_extent_tag);
+    // Create a file to work with (recording it in the manifest first,
+    // and removing any reference, as storage does)
+    manifest_insert(extent_tag);
+    sprintf(filename, REF_TEMPLATE, blockdir, extent_tag);
+    VSIUnlink(filename);
+    sprintf(filename, EXTENT_TEMPLATE, blockdir, extent_tag);
     VSILFILE *handle = VSIFOpenL(filename, "w");
 
     // Create an extent and store it in the file
     extent = new uint8_t[EXTENT_SIZE];
     memset(extent, 0xaa, EXTENT_SIZE);
     VSIFWriteL(extent, EXTENT_SIZE, 1, handle);
-    delete extent;
+    delete[] extent;
 
     // Close the file
     VSIFCloseL(handle);
 }
 
+void freshen_extent(uint64_t extent_tag)
+{
+    freshen_extent("/vsimem", extent_tag);
+}
+
+void freshen_file()
+{
+    freshen_extent(backed_extent_tag);
+}
+
 BOOST_AUTO_TEST_CASE(aligned_page_read_backed)
 {
     uint8_t page[PAGE_SIZE] = {};
@@ -146,7 +205,7 @@ BOOST_AUTO_TEST_CASE(storage_read_unaligned_1)
     BOOST_TEST(bytes[0] == 0x33);
     BOOST_TEST(bytes[bytes_read] == 0x55);
 
-    delete bytes;
+    delete[] bytes;
     storage_deinit();
 }
 
@@ -166,7 +225,7 @@ BOOST_AUTO_TEST_CASE(storage_read_unaligned_2)
     BOOST_TEST(bytes[0] == 0xaa);
     BOOST_TEST(bytes[bytes_read] == 0x55);
 
-    delete bytes;
+    delete[] bytes;
     storage_deinit();
 }
 
@@ -187,7 +246,7 @@ BOOST_AUTO_TEST_CASE(storage_read_aligned)
     BOOST_TEST(bytes[bytes_read - 1] == 0xaa);
     BOOST_TEST(bytes[bytes_read] == 0x55);
 
-    delete bytes;
+    delete[] bytes;
     storage_deinit();
 }
 
@@ -213,7 +272,7 @@ BOOST_AUTO_TEST_CASE(storage_write_unaligned_1)
     BOOST_TEST(bytes[bytes_read - 1] == 0x55);
     BOOST_TEST(bytes[bytes_read] == 0x00);
 
-    delete bytes;
+    delete[] bytes;
     storage_deinit();
 }
 
@@ -238,7 +297,7 @@ BOOST_AUTO_TEST_CASE(storage_write_unaligned_2)
     BOOST_TEST(bytes[bytes_read - 1] == 0x55);
     BOOST_TEST(bytes[bytes_read] == 0x00);
 
-    delete bytes;
+    delete[] bytes;
     storage_deinit();
 }
 
@@ -264,6 +323,1092 @@ BOOST_AUTO_TEST_CASE(storage_write_aligned)
     BOOST_TEST(bytes[bytes_read - 1] == 0x55);
     BOOST_TEST(bytes[bytes_read] == 0x00);
 
-    delete bytes;
+    delete[] bytes;
+    storage_deinit();
+}
+
+BOOST_AUTO_TEST_CASE(readahead_sequential)
+{
+    uint8_t page[PAGE_SIZE] = {};
+    uint64_t before = 0, after = 0;
+
+    storage_init("/vsimem");
+    freshen_file();
+
+    // Extents that were never stored are not worth reading ahead, so
+    // store the ones that follow
+    for (uint64_t i = 1; i <= READAHEAD_DEFAULT_EXTENTS; ++i)
+    {
+        freshen_extent(backed_extent_tag + i * EXTENT_SIZE);
+    }
+
+    storage_metric("readahead_fetches", &before);
+    for (int i = 0; i < 4; ++i)
+    {
+        storage_read(backed_extent_tag + (i * PAGE_SIZE), PAGE_SIZE, page);
+    }
+    for (int i = 0; i < 100 && after <= before; ++i)
+    {
+        usleep(10000);
+        storage_metric("readahead_fetches", &after);
+    }
+    BOOST_TEST(after > before);
+
+    storage_deinit();
+
+    for (uint64_t i = 1; i <= READAHEAD_DEFAULT_EXTENTS; ++i)
+    {
+        char filename[0x100];
+
+        sprintf(filename, EXTENT_TEMPLATE, "/vsimem", backed_extent_tag + i * EXTENT_SIZE);
+        VSIUnlink(filename);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(storage_flush_partial_extent)
+{
+    uint8_t page[PAGE_SIZE] = {};
+    uint64_t page_tag = backed_extent_tag + (5 * PAGE_SIZE);
+    char filename[0x100];
+    VSILFILE *handle = NULL;
+
+    // The extent is inspected at its position
+    unsetenv(S3BD_DEDUP);
+    storage_init("/vsimem");
+    freshen_file();
+
+    // Only one page of the extent is brought into the scratch file
+    memset(page, 0x01, PAGE_SIZE);
+    aligned_whole_page_write(page_tag, page);
+    BOOST_TEST(storage_flush(backed_extent_tag));
+
+    // The stored extent is complete
+    sprintf(filename, EXTENT_TEMPLATE, "/vsimem", backed_extent_tag);
+    handle = VSIFOpenL(filename, "r");
+    BOOST_TEST(handle != nullptr);
+    VSIFSeekL(handle, 5 * PAGE_SIZE, SEEK_SET);
+    VSIFReadL(page, PAGE_SIZE, 1, handle);
+    BOOST_TEST(page[0] == 0x01);
+    VSIFReadL(page, PAGE_SIZE, 1, handle);
+    BOOST_TEST(page[0] == 0xaa);
+    VSIFSeekL(handle, 0, SEEK_END);
+    BOOST_TEST(VSIFTellL(handle) == EXTENT_SIZE);
+    VSIFCloseL(handle);
+
+    storage_deinit();
+}
+
+BOOST_AUTO_TEST_CASE(scratch_mmap_allocated)
+{
+    const uint64_t extent_tag = 0x300 * EXTENT_SIZE;
+    bool mapped = (getenv(S3BD_SCRATCH_MMAP) != nullptr);
+    struct stat st;
+
+    // A mapped extent is backed by allocated blocks, so that storing
+    // to it cannot fault for want of space
+    setenv(S3BD_SCRATCH_MMAP, "1", 1);
+    storage_init("/vsimem");
+    uint8_t *window = scratch_extent(extent_tag);
+    if (window != nullptr)
+    {
+        BOOST_TEST(fstat(scratch_descriptor(), &st) == 0);
+        BOOST_TEST(static_cast<uint64_t>(st.st_size) >= extent_tag + EXTENT_SIZE);
+        BOOST_TEST(static_cast<uint64_t>(st.st_blocks) * 512 >= EXTENT_SIZE);
+        window[EXTENT_SIZE - 1] = 0x01;
+    }
+    else
+    {
+        uint64_t unmapped = 0;
+
+        BOOST_TEST(storage_metric("scratch_unmapped", &unmapped) == 1);
+        BOOST_TEST(unmapped > 0);
+    }
+    scratch_punch(extent_tag, EXTENT_SIZE);
+    storage_deinit();
+    if (!mapped)
+    {
+        unsetenv(S3BD_SCRATCH_MMAP);
+    }
+}
+
+void *uring_reader(void *arg)
+{
+    uint8_t page[PAGE_SIZE];
+
+    aligned_page_read(backed_extent_tag + (4 * PAGE_SIZE), PAGE_SIZE, page);
+    return nullptr;
+}
+
+BOOST_AUTO_TEST_CASE(scratch_uring)
+{
+    uint8_t page[PAGE_SIZE], page2[PAGE_SIZE];
+    uint64_t page_tag = backed_extent_tag + (3 * PAGE_SIZE);
+    uint64_t ops = 0, rings_before = 0, rings_after = 0;
+
+    // The engine may be missing at build time or at run time; either
+    // way the scratch file behaves the same
+    setenv(S3BD_SCRATCH_URING, "1", 1);
+    storage_init("/vsimem");
+    freshen_file();
+
+    memset(page, 0x23, PAGE_SIZE);
+    BOOST_TEST(aligned_whole_page_write(page_tag, page));
+    BOOST_TEST(storage_flush(backed_extent_tag, true));
+    BOOST_TEST(aligned_page_read(page_tag, PAGE_SIZE, page2));
+    BOOST_TEST(memcmp(page, page2, PAGE_SIZE) == 0);
+    BOOST_TEST(aligned_page_read(page_tag + PAGE_SIZE, PAGE_SIZE, page2));
+    BOOST_TEST(page2[0] == 0xaa);
+    if (scratch_buffer() != nullptr)
+    {
+        BOOST_TEST(storage_metric("uring_ops", &ops) == 1);
+        BOOST_TEST(ops > 0);
+    }
+
+    // A thread's ring goes away with the thread
+    if (storage_metric("uring_rings", &rings_before) == 1)
+    {
+        pthread_t thread;
+
+        pthread_create(&thread, nullptr, uring_reader, nullptr);
+        pthread_join(thread, nullptr);
+        storage_metric("uring_rings", &rings_after);
+        BOOST_TEST(rings_after == rings_before);
+    }
+
+    storage_deinit();
+    unsetenv(S3BD_SCRATCH_URING);
+    if (storage_metric("uring_rings", &rings_after) == 1)
+    {
+        BOOST_TEST(rings_after == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(storage_pins)
+{
+    uint8_t page[PAGE_SIZE], page2[PAGE_SIZE];
+    uint64_t page_tag = backed_extent_tag + (6 * PAGE_SIZE);
+    int fd = -1;
+    off_t fd_offset = 0;
+
+    storage_init("/vsimem");
+    freshen_file();
+
+    // A span that is not in the local cache cannot be pinned for reading
+    BOOST_TEST(storage_read_pin(page_tag, PAGE_SIZE, &fd, &fd_offset) == 0);
+
+    // A span written through the descriptor is dirty and readable
+    memset(page, 0x25, PAGE_SIZE);
+    BOOST_TEST(storage_write_pin(page_tag + 0x10, PAGE_SIZE - 0x20, &fd, &fd_offset) == 1);
+    BOOST_TEST(pwrite(fd, page, PAGE_SIZE - 0x20, fd_offset) == static_cast<ssize_t>(PAGE_SIZE - 0x20));
+    storage_write_unpin(page_tag + 0x10, PAGE_SIZE - 0x20, 1);
+    BOOST_TEST(extent_dirty(backed_extent_tag));
+    BOOST_TEST(aligned_page_read(page_tag, PAGE_SIZE, page2));
+    BOOST_TEST(page2[0x0f] == 0xaa);
+    BOOST_TEST(page2[0x10] == 0x25);
+    BOOST_TEST(page2[PAGE_SIZE - 0x11] == 0x25);
+    BOOST_TEST(page2[PAGE_SIZE - 0x10] == 0xaa);
+
+    // Now it can be read through the descriptor
+    BOOST_TEST(storage_read_pin(page_tag, PAGE_SIZE, &fd, &fd_offset) == 1);
+    BOOST_TEST(pread(fd, page, PAGE_SIZE, fd_offset) == static_cast<ssize_t>(PAGE_SIZE));
+    storage_read_unpin(page_tag);
+    BOOST_TEST(memcmp(page, page2, PAGE_SIZE) == 0);
+
+    // Spans that cross extents are not pinned
+    BOOST_TEST(storage_read_pin(backed_extent_tag + EXTENT_SIZE - PAGE_SIZE, 2 * PAGE_SIZE, &fd, &fd_offset) == 0);
+    BOOST_TEST(storage_write_pin(backed_extent_tag + EXTENT_SIZE - PAGE_SIZE, 2 * PAGE_SIZE, &fd, &fd_offset) == 0);
+
+    storage_deinit();
+}
+
+BOOST_AUTO_TEST_CASE(storage_write_spans)
+{
+    off_t offset = backed_extent_tag + EXTENT_SIZE - (16 * PAGE_SIZE) + 7;
+    size_t size = 32 * PAGE_SIZE;
+    uint8_t *bytes = new uint8_t[size + 2];
+    int bytes_read = 0;
+    int bytes_written = 0;
+
+    storage_init("/vsimem");
+    freshen_file();
+
+    memset(bytes, 0x55, size);
+    bytes_written = storage_write(offset, size, bytes);
+    BOOST_TEST(bytes_written == size);
+
+    // The bytes on either side of the write are untouched
+    memset(bytes, 0, size + 2);
+    bytes_read = storage_read(offset - 1, size + 2, bytes);
+    BOOST_TEST(bytes_read == size + 2);
+    BOOST_TEST(bytes[0] == 0xaa);
+    BOOST_TEST(bytes[1] == 0x55);
+    BOOST_TEST(bytes[size] == 0x55);
+    BOOST_TEST(bytes[size + 1] == 0x33);
+
+    delete[] bytes;
+    storage_deinit();
+}
+
+static std::atomic<bool> extent_lock_acquired{false};
+
+void *extent_lock_thread(void *arg)
+{
+    bool *wrlock = reinterpret_cast<bool *>(arg);
+
+    extent_lock_wait(backed_extent_tag, *wrlock, false);
+    extent_lock_acquired = true;
+    extent_unlock(backed_extent_tag, *wrlock, false);
+    return nullptr;
+}
+
+BOOST_AUTO_TEST_CASE(extent_lock_blocking)
+{
+    pthread_t thread;
+    bool wrlock, kept_out = false;
+    uint64_t waits_before = 0, waits_after = 0;
+
+    storage_init("/vsimem");
+    storage_metric("extent_lock_waits", &waits_before);
+
+    // A reader does not get in until the writer leaves
+    wrlock = false;
+    extent_lock_acquired = false;
+    extent_lock_wait(backed_extent_tag, true, false);
+    pthread_create(&thread, NULL, extent_lock_thread, &wrlock);
+    usleep(50000);
+    BOOST_TEST(!extent_lock_acquired);
+    extent_unlock(backed_extent_tag, true, false);
+    pthread_join(thread, nullptr);
+    BOOST_TEST(extent_lock_acquired);
+
+    // A waiting writer keeps new readers out (once it is waiting)
+    wrlock = true;
+    extent_lock_wait(backed_extent_tag, false, false);
+    pthread_create(&thread, NULL, extent_lock_thread, &wrlock);
+    for (int i = 0; i < 100 && !kept_out; ++i)
+    {
+        kept_out = !extent_lock(backed_extent_tag, false);
+        if (!kept_out)
+        {
+            extent_unlock(backed_extent_tag, false, false);
+            usleep(10000);
+        }
+    }
+    BOOST_TEST(kept_out);
+    extent_unlock(backed_extent_tag, false, false);
+    pthread_join(thread, nullptr);
+
+    // The writer certainly waited; the reader may not have had to
+    storage_metric("extent_lock_waits", &waits_after);
+    BOOST_TEST(waits_after >= waits_before + 1);
+
+    storage_deinit();
+}
+
+BOOST_AUTO_TEST_CASE(storage_read_stays_clean)
+{
+    uint8_t page[PAGE_SIZE] = {};
+
+    storage_init("/vsimem");
+    freshen_file();
+
+    // Both the slow path and the fast path leave the extent clean
+    storage_read(backed_extent_tag, PAGE_SIZE, page);
+    storage_read(backed_extent_tag, PAGE_SIZE, page);
+    BOOST_TEST(page[0] == 0xaa);
+    BOOST_TEST(extent_clean(backed_extent_tag));
+
+    // A write dirties it
+    storage_write(backed_extent_tag, PAGE_SIZE, page);
+    BOOST_TEST(extent_dirty(backed_extent_tag));
+
+    storage_deinit();
+}
+
+BOOST_AUTO_TEST_CASE(storage_read_gathers_holes)
+{
+    uint64_t window = FETCH_DEFAULT_PAGES * PAGE_SIZE;
+    size_t size = 3 * window;
+    uint8_t *bytes = new uint8_t[size];
+    uint64_t before = 0, after = 0;
+
+    storage_init("/vsimem");
+    freshen_file();
+
+    // Make the middle window present, leaving a hole on either side
+    memset(bytes, 0x55, window);
+    BOOST_TEST(storage_write(backed_extent_tag + window, window, bytes) == window);
+
+    // Both holes are fetched with one request
+    storage_metric("remote_reads", &before);
+    BOOST_TEST(storage_read(backed_extent_tag, size, bytes) == size);
+    storage_metric("remote_reads", &after);
+    BOOST_TEST(after == before + 1);
+    BOOST_TEST(bytes[0] == 0xaa);
+    BOOST_TEST(bytes[window - 1] == 0xaa);
+    BOOST_TEST(bytes[window] == 0x55);
+    BOOST_TEST(bytes[2 * window - 1] == 0x55);
+    BOOST_TEST(bytes[2 * window] == 0xaa);
+    BOOST_TEST(bytes[size - 1] == 0xaa);
+
+    delete[] bytes;
+    storage_deinit();
+}
+
+BOOST_AUTO_TEST_CASE(volume_extent_size)
+{
+    const char *blockdir = "/vsimem/small";
+    uint64_t extent_size = 1 << 20;
+    uint8_t page[PAGE_SIZE];
+    char filename[0x100];
+    VSIStatBufL stat;
+
+    // A new volume gets the extent size it is given
+    unset_environment();
+    setenv(S3BD_EXTENT_KILOBYTES, "1024", 1);
+    BOOST_TEST(storage_init(blockdir) == 1);
+    BOOST_TEST(EXTENT_SIZE == extent_size);
+    memset(page, 0x01, PAGE_SIZE);
+    BOOST_TEST(aligned_whole_page_write(extent_size + PAGE_SIZE, page));
+    BOOST_TEST(storage_flush(extent_size));
+    storage_deinit();
+
+    sprintf(filename, EXTENT_TEMPLATE, blockdir, extent_size);
+    BOOST_TEST(VSIStatL(filename, &stat) == 0);
+    BOOST_TEST(stat.st_size == extent_size);
+
+    // A remount keeps it
+    setenv(S3BD_EXTENT_KILOBYTES, "8192", 1);
+    BOOST_TEST(storage_init(blockdir) == 1);
+    BOOST_TEST(EXTENT_SIZE == extent_size);
+    memset(page, 0, PAGE_SIZE);
+    BOOST_TEST(aligned_page_read(extent_size + PAGE_SIZE, PAGE_SIZE, page));
+    BOOST_TEST(page[0] == 0x01);
+    storage_deinit();
+    unsetenv(S3BD_EXTENT_KILOBYTES);
+
+    // A volume whose header cannot be understood is not mounted
+    VSILFILE *handle = VSIFOpenL("/vsimem/garbled/volume", "w");
+    VSIFWriteL("garbage", 7, 1, handle);
+    VSIFCloseL(handle);
+    BOOST_TEST(storage_init("/vsimem/garbled") == 0);
+
+    // And its header is left as it was
+    BOOST_TEST(VSIStatL("/vsimem/garbled/volume", &stat) == 0);
+    BOOST_TEST(stat.st_size == 7);
+
+    BOOST_TEST(EXTENT_SIZE == PAGE_SIZE * EXTENT_DEFAULT_PAGES);
+}
+
+BOOST_AUTO_TEST_CASE(persistent_cache_remount)
+{
+    const char *blockdir = "/vsimem/warm";
+    uint64_t page_tag = EXTENT_SIZE + (3 * PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t before = 0, after = 0;
+    char filename[0x100];
+
+    setenv(S3BD_PERSISTENT_CACHE, "unit_tests", 1);
+
+    // Fill the cache
+    storage_init(blockdir);
+    memset(page, 0x07, PAGE_SIZE);
+    BOOST_TEST(aligned_whole_page_write(page_tag, page));
+    storage_deinit();
+
+    // A remount reads from it
+    storage_init(blockdir);
+    memset(page, 0, PAGE_SIZE);
+    storage_metric("remote_reads", &before);
+    BOOST_TEST(aligned_page_read(page_tag, PAGE_SIZE, page));
+    storage_metric("remote_reads", &after);
+    BOOST_TEST(page[0] == 0x07);
+    BOOST_TEST(after == before);
+    storage_deinit();
+
+    // Unless something else has stored an extent in the meantime
+    unsetenv(S3BD_PERSISTENT_CACHE);
+    storage_init(blockdir);
+    memset(page, 0x08, PAGE_SIZE);
+    BOOST_TEST(aligned_whole_page_write(page_tag, page));
+    BOOST_TEST(storage_flush(page_tag & (~EXTENT_MASK)));
+    storage_deinit();
+
+    setenv(S3BD_PERSISTENT_CACHE, "unit_tests", 1);
+    storage_init(blockdir);
+    memset(page, 0, PAGE_SIZE);
+    storage_metric("remote_reads", &before);
+    BOOST_TEST(aligned_page_read(page_tag, PAGE_SIZE, page));
+    storage_metric("remote_reads", &after);
+    BOOST_TEST(page[0] == 0x08);
+    BOOST_TEST(after > before);
+    storage_deinit();
+
+    // Only one mount at a time may use the cache, and a refused mount
+    // leaves it alone
+    sprintf(filename, SCRATCH_PERSISTENT_TEMPLATE, SCRATCH_DEFAULT_DIR, "unit_tests");
+    int fd = open(filename, O_RDWR);
+    BOOST_TEST(flock(fd, LOCK_EX | LOCK_NB) == 0);
+    BOOST_TEST(storage_init(blockdir) == 0);
+    close(fd);
+    BOOST_TEST(storage_init(blockdir) == 1);
+    memset(page, 0, PAGE_SIZE);
+    storage_metric("remote_reads", &before);
+    BOOST_TEST(aligned_page_read(page_tag, PAGE_SIZE, page));
+    storage_metric("remote_reads", &after);
+    BOOST_TEST(page[0] == 0x08);
+    BOOST_TEST(after == before);
+    storage_deinit();
+
+    // A block directory whose name the record cannot hold is refused
+    std::string long_blockdir = std::string{"/vsimem/"} + std::string(0x100, 'w');
+    BOOST_TEST(storage_init(long_blockdir.c_str()) == 0);
+    unsetenv(S3BD_PERSISTENT_CACHE);
+
+    unlink(filename);
+    strcat(filename, ".warm");
+    unlink(filename);
+}
+
+BOOST_AUTO_TEST_CASE(dirty_writeback_due)
+{
+    uint64_t page_tag = backed_extent_tag + (9 * PAGE_SIZE);
+    uint64_t forever = UINT64_MAX;
+    uint8_t page[PAGE_SIZE];
+    std::vector<uint64_t> extent_tags;
+    uint64_t before = 0, after = 0;
+
+    storage_init("/vsimem");
+    freshen_file();
+
+    storage_metric("bytes_written", &before);
+    memset(page, 0x09, PAGE_SIZE);
+    BOOST_TEST(aligned_whole_page_write(page_tag, page));
+    storage_metric("bytes_written", &after);
+    BOOST_TEST(after == before + PAGE_SIZE);
+
+    // A freshly written extent is not due yet, unless it is allowed to
+    // be idle or dirty for no time at all
+    extent_due(&extent_tags, forever, forever);
+    BOOST_TEST(extent_tags.empty());
+    extent_due(&extent_tags, 0, forever);
+    BOOST_TEST(extent_tags == std::vector<uint64_t>{backed_extent_tag});
+    extent_due(&extent_tags, forever, 0);
+    BOOST_TEST(extent_tags == std::vector<uint64_t>{backed_extent_tag});
+
+    // Writing it back costs a whole extent
+    BOOST_TEST(storage_flush(backed_extent_tag));
+    extent_due(&extent_tags, 0, 0);
+    BOOST_TEST(extent_tags.empty());
+    BOOST_TEST(storage_metric("upload_amplification_percent", &after) == 1);
+    BOOST_TEST(after > 100);
+
+    storage_deinit();
+}
+
+BOOST_AUTO_TEST_CASE(dirty_backpressure)
+{
+    const char *blockdir = "/vsimem/backpressure";
+    const uint64_t first_tag = 0x100 * EXTENT_SIZE;
+    uint8_t page[PAGE_SIZE];
+    uint64_t dirty = 0, blocked = 0;
+
+    // A cache of ten extents may hold one dirty extent before writers
+    // are throttled, and two before they are stopped
+    unset_environment();
+    setenv(S3BD_LOCAL_CACHE_MEGABYTES, "40", 1);
+    setenv(S3BD_DIRTY_BACKGROUND_RATIO, "10", 1);
+    setenv(S3BD_DIRTY_RATIO, "20", 1);
+    storage_init(blockdir);
+
+    memset(page, 0x21, PAGE_SIZE);
+    for (uint64_t i = 0; i < 4; ++i)
+    {
+        BOOST_TEST(storage_write(first_tag + i * EXTENT_SIZE, PAGE_SIZE, page) == static_cast<int>(PAGE_SIZE));
+        storage_metric("dirty_bytes", &dirty);
+        BOOST_TEST(dirty <= 2 * EXTENT_SIZE);
+    }
+    storage_metric("blocked_writes", &blocked);
+    BOOST_TEST(blocked >= 1);
+
+    storage_deinit();
+    unsetenv(S3BD_DIRTY_RATIO);
+    unsetenv(S3BD_DIRTY_BACKGROUND_RATIO);
+    unsetenv(S3BD_LOCAL_CACHE_MEGABYTES);
+}
+
+void *storage_sync_thread(void *arg)
+{
+    *reinterpret_cast<int *>(arg) = storage_sync();
+    return nullptr;
+}
+
+BOOST_AUTO_TEST_CASE(sync_group_commit)
+{
+    const uint64_t first_tag = 0x200 * EXTENT_SIZE;
+    const int threads = 8;
+    pthread_t thread[threads];
+    int result[threads];
+    uint8_t page[PAGE_SIZE], page2[PAGE_SIZE];
+    uint64_t syncs = 0, epochs = 0;
+
+    storage_init("/vsimem");
+
+    // Nothing is due for writeback yet, so only syncing uploads these
+    memset(page, 0x22, PAGE_SIZE);
+    for (uint64_t i = 0; i < 4; ++i)
+    {
+        BOOST_TEST(aligned_whole_page_write(first_tag + i * EXTENT_SIZE, page));
+    }
+    for (int i = 0; i < threads; ++i)
+    {
+        pthread_create(&thread[i], NULL, storage_sync_thread, &result[i]);
+    }
+    for (int i = 0; i < threads; ++i)
+    {
+        pthread_join(thread[i], NULL);
+        BOOST_TEST(result[i] == 0);
+    }
+    for (uint64_t i = 0; i < 4; ++i)
+    {
+        BOOST_TEST(extent_clean(first_tag + i * EXTENT_SIZE));
+    }
+
+    // Concurrent syncs share epochs
+    storage_metric("syncs", &syncs);
+    storage_metric("sync_epochs", &epochs);
+    BOOST_TEST(epochs >= 1);
+    BOOST_TEST(epochs <= syncs);
+
+    storage_deinit();
+
+    // The data survives the local cache
+    storage_init("/vsimem");
+    for (uint64_t i = 0; i < 4; ++i)
+    {
+        BOOST_TEST(aligned_page_read(first_tag + i * EXTENT_SIZE, PAGE_SIZE, page2));
+        BOOST_TEST(memcmp(page, page2, PAGE_SIZE) == 0);
+    }
+    storage_deinit();
+
+    for (uint64_t i = 0; i < 4; ++i)
+    {
+        char filename[0x100];
+
+        sprintf(filename, EXTENT_TEMPLATE, "/vsimem", first_tag + i * EXTENT_SIZE);
+        VSIUnlink(filename);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(writeback_scheduling)
+{
+    const uint64_t a = 1 * EXTENT_SIZE, b = 2 * EXTENT_SIZE, c = 3 * EXTENT_SIZE;
+    uint64_t extent_tag = 0;
+    bool should_remove = false;
+
+    writeback_init();
+
+    // Evictions come before background writeback, and requests for
+    // the same extent are merged
+    writeback_request(a, WRITEBACK_BACKGROUND, false);
+    writeback_request(b, WRITEBACK_BACKGROUND, false);
+    writeback_request(c, WRITEBACK_EVICTION, true);
+    writeback_request(a, WRITEBACK_EVICTION, true);
+
+    BOOST_TEST(writeback_next(&extent_tag, &should_remove));
+    BOOST_TEST(extent_tag == a);
+    BOOST_TEST(should_remove);
+    BOOST_TEST(writeback_next(&extent_tag, &should_remove));
+    BOOST_TEST(extent_tag == c);
+    BOOST_TEST(should_remove);
+
+    // An extent requested again while it is in flight waits for it
+    writeback_request(c, WRITEBACK_SYNC, false);
+    BOOST_TEST(writeback_next(&extent_tag, &should_remove));
+    BOOST_TEST(extent_tag == b);
+    BOOST_TEST(!should_remove);
+    writeback_done(c);
+    BOOST_TEST(writeback_next(&extent_tag, &should_remove));
+    BOOST_TEST(extent_tag == c);
+    BOOST_TEST(!should_remove);
+    writeback_done(a);
+    writeback_done(b);
+    writeback_done(c);
+
+    // Stopping wakes anyone waiting
+    writeback_stop();
+    BOOST_TEST(!writeback_next(&extent_tag, &should_remove));
+    BOOST_TEST(!writeback_sleep(1000000000));
+
+    writeback_deinit();
+}
+
+BOOST_AUTO_TEST_CASE(residency_tracking)
+{
+    const char *blockdir = "/vsimem/residency";
+    uint8_t page[PAGE_SIZE] = {};
+    uint64_t extent_end = backed_extent_tag + EXTENT_SIZE;
+
+    unset_environment();
+    storage_init(blockdir);
+    freshen_extent(blockdir, backed_extent_tag);
+
+    // Nothing is resident to begin with
+    BOOST_TEST(residency_next_hole(backed_extent_tag) == backed_extent_tag);
+    BOOST_TEST(residency_next_data(backed_extent_tag) == extent_end);
+
+    // A whole-page write makes exactly that page resident
+    storage_write(backed_extent_tag + 2 * PAGE_SIZE, PAGE_SIZE, page);
+    BOOST_TEST(residency_next_data(backed_extent_tag) == backed_extent_tag + 2 * PAGE_SIZE);
+    BOOST_TEST(residency_next_hole(backed_extent_tag + 2 * PAGE_SIZE) == backed_extent_tag + 3 * PAGE_SIZE);
+
+    // Evicting the extent forgets it
+    BOOST_TEST(storage_flush(backed_extent_tag, true));
+    BOOST_TEST(residency_next_data(backed_extent_tag) == extent_end);
+
+    storage_deinit();
+}
+
+static std::vector<uint64_t> lru_evicted;
+
+void *lru_record_eviction(void *arg)
+{
+    lru_evicted.push_back(reinterpret_cast<uint64_t>(arg));
+    return nullptr;
+}
+
+BOOST_AUTO_TEST_CASE(lru_clock_eviction)
+{
+    // A cache with room for one extent evicts the previous one
+    setenv(S3BD_LOCAL_CACHE_MEGABYTES, "4", 1);
+    lru_evicted.clear();
+    lru_init(lru_record_eviction);
+    lru_report_extent(0 * EXTENT_SIZE);
+    lru_report_extent(1 * EXTENT_SIZE);
+    lru_report_extent(1 * EXTENT_SIZE);
+    lru_report_extent(0 * EXTENT_SIZE);
+    lru_deinit();
+    BOOST_TEST(lru_evicted.size() == 2);
+    BOOST_TEST(lru_evicted[0] == 0 * EXTENT_SIZE);
+    BOOST_TEST(lru_evicted[1] == 1 * EXTENT_SIZE);
+
+    // A larger cache holds exactly its capacity
+    setenv(S3BD_LOCAL_CACHE_MEGABYTES, "64", 1);
+    lru_evicted.clear();
+    lru_init(lru_record_eviction);
+    for (uint64_t i = 0; i < 1000; ++i)
+    {
+        lru_report_extent(i * EXTENT_SIZE);
+    }
+    lru_deinit();
+    BOOST_TEST(lru_evicted.size() == 1000 - 16);
+    unsetenv(S3BD_LOCAL_CACHE_MEGABYTES);
+}
+
+/**
+ * Warm a cache of eight extents up with a hot pair, run a scan of cold
+ * extents through it, and count the misses when the hot pair comes back.
+ */
+uint64_t lru_misses_after_scan(const char *policy)
+{
+    uint64_t before, after;
+
+    setenv(S3BD_LOCAL_CACHE_MEGABYTES, "32", 1);
+    setenv(S3BD_EVICTION_POLICY, policy, 1);
+    lru_evicted.clear();
+    lru_init(lru_record_eviction);
+
+    uint64_t cold = 100;
+    for (int round = 0; round < 8; ++round)
+    {
+        lru_report_extent(0 * EXTENT_SIZE);
+        lru_report_extent(1 * EXTENT_SIZE);
+        for (int i = 0; i < 3; ++i)
+        {
+            lru_report_extent((cold++) * EXTENT_SIZE);
+        }
+    }
+    for (int i = 0; i < 100; ++i)
+    {
+        lru_report_extent((cold++) * EXTENT_SIZE);
+    }
+
+    storage_metric("lru_misses", &before);
+    lru_report_extent(0 * EXTENT_SIZE);
+    lru_report_extent(1 * EXTENT_SIZE);
+    storage_metric("lru_misses", &after);
+
+    lru_deinit();
+    unsetenv(S3BD_EVICTION_POLICY);
+    unsetenv(S3BD_LOCAL_CACHE_MEGABYTES);
+    return after - before;
+}
+
+BOOST_AUTO_TEST_CASE(lru_policies)
+{
+    const char *policies[] = {"clock", "lru", "2q", "s3fifo"};
+
+    // Every policy holds exactly its capacity
+    for (auto policy : policies)
+    {
+        setenv(S3BD_LOCAL_CACHE_MEGABYTES, "32", 1);
+        setenv(S3BD_EVICTION_POLICY, policy, 1);
+        lru_evicted.clear();
+        lru_init(lru_record_eviction);
+        for (uint64_t i = 0; i < 100; ++i)
+        {
+            lru_report_extent(i * EXTENT_SIZE);
+            lru_report_extent(i * EXTENT_SIZE);
+        }
+        lru_deinit();
+        BOOST_TEST(lru_evicted.size() == 100 - 8);
+    }
+    unsetenv(S3BD_EVICTION_POLICY);
+    unsetenv(S3BD_LOCAL_CACHE_MEGABYTES);
+
+    // A scan pushes the hot extents out of an LRU, but not out of the
+    // scan-resistant policies
+    BOOST_TEST(lru_misses_after_scan("lru") == 2);
+    BOOST_TEST(lru_misses_after_scan("2q") == 0);
+    BOOST_TEST(lru_misses_after_scan("s3fifo") == 0);
+}
+
+BOOST_AUTO_TEST_CASE(remote_compression_roundtrip)
+{
+    uint8_t page[PAGE_SIZE];
+    char filename[0x100];
+    VSIStatBufL stat;
+
+    setenv(S3BD_COMPRESSION, "zstd", 1);
+    storage_init("/vsimem");
+    freshen_file();
+
+    // Existing raw objects can still be read
+    storage_read(backed_extent_tag + 3 * PAGE_SIZE, PAGE_SIZE, page);
+    BOOST_TEST(page[0] == 0xaa);
+
+    // The stored object is never larger than a raw extent
+    memset(page, 0x55, PAGE_SIZE);
+    storage_write(backed_extent_tag + 5 * PAGE_SIZE, PAGE_SIZE, page);
+    BOOST_TEST(storage_flush(backed_extent_tag, true));
+    sprintf(filename, EXTENT_TEMPLATE, "/vsimem", backed_extent_tag);
+    BOOST_TEST(VSIStatL(filename, &stat) == 0);
+    BOOST_TEST(static_cast<uint64_t>(stat.st_size) <= EXTENT_SIZE);
+    storage_deinit();
+    unsetenv(S3BD_COMPRESSION);
+
+    // It reads back the same, whatever the codec of the mount
+    storage_init("/vsimem");
+    storage_read(backed_extent_tag + 5 * PAGE_SIZE, PAGE_SIZE, page);
+    BOOST_TEST(page[0] == 0x55);
+    storage_read(backed_extent_tag + 3 * PAGE_SIZE, PAGE_SIZE, page);
+    BOOST_TEST(page[PAGE_SIZE - 1] == 0xaa);
+    storage_deinit();
+}
+
+BOOST_AUTO_TEST_CASE(zero_extent_elision)
+{
+    const char *blockdir = "/vsimem/zero";
+    uint8_t page[PAGE_SIZE];
+    char filename[0x100];
+    uint64_t fetched_before, fetched_after, zeros_before, zeros_after;
+    uint64_t reads_before, reads_after;
+    VSIStatBufL stat;
+
+    unset_environment();
+    storage_init(blockdir);
+    freshen_extent(blockdir, backed_extent_tag);
+
+    // Overwrite the whole extent with zeros and flush it
+    memset(page, 0, PAGE_SIZE);
+    for (uint64_t i = 0; i < PAGES_PER_EXTENT; ++i)
+    {
+        storage_write(backed_extent_tag + i * PAGE_SIZE, PAGE_SIZE, page);
+    }
+    storage_metric("remote_zero_extents", &zeros_before);
+    BOOST_TEST(storage_flush(backed_extent_tag));
+    storage_metric("remote_zero_extents", &zeros_after);
+    BOOST_TEST(zeros_after == zeros_before + 1);
+
+    // Only a header is stored, and the scratch file keeps nothing
+    sprintf(filename, EXTENT_TEMPLATE, blockdir, backed_extent_tag);
+    BOOST_TEST(VSIStatL(filename, &stat) == 0);
+    BOOST_TEST(static_cast<uint64_t>(stat.st_size) < PAGE_SIZE);
+    BOOST_TEST(residency_next_data(backed_extent_tag) == backed_extent_tag + EXTENT_SIZE);
+
+    // Reads are zeros and fetch nothing
+    memset(page, 0xff, PAGE_SIZE);
+    storage_metric("remote_bytes_fetched", &fetched_before);
+    storage_read(backed_extent_tag + 7 * PAGE_SIZE + 1, PAGE_SIZE, page);
+    storage_metric("remote_bytes_fetched", &fetched_after);
+    BOOST_TEST(page[0] == 0x00);
+    BOOST_TEST(page[PAGE_SIZE - 1] == 0x00);
+    BOOST_TEST(fetched_after == fetched_before);
+    BOOST_TEST(residency_next_data(backed_extent_tag) == backed_extent_tag + EXTENT_SIZE);
+
+    // After a remount, the extent is still known to be zeros without
+    // being read
+    storage_deinit();
+    storage_init(blockdir);
+    memset(page, 0xff, PAGE_SIZE);
+    storage_metric("remote_reads", &reads_before);
+    storage_read(backed_extent_tag + 9 * PAGE_SIZE, PAGE_SIZE, page);
+    storage_metric("remote_reads", &reads_after);
+    BOOST_TEST(page[0] == 0x00);
+    BOOST_TEST(reads_after == reads_before);
+    BOOST_TEST(residency_next_data(backed_extent_tag) == backed_extent_tag + EXTENT_SIZE);
+
+    // A partial write is read back through the zeros around it
+    memset(page, 0x42, PAGE_SIZE);
+    storage_write(backed_extent_tag + 8 * PAGE_SIZE, 16, page);
+    storage_read(backed_extent_tag + 8 * PAGE_SIZE - 8, 32, page);
+    BOOST_TEST(page[7] == 0x00);
+    BOOST_TEST(page[8] == 0x42);
+    BOOST_TEST(page[23] == 0x42);
+    BOOST_TEST(page[24] == 0x00);
+
+    storage_deinit();
+}
+
+BOOST_AUTO_TEST_CASE(dedup_identical_extents)
+{
+    const uint64_t first_tag = 2 * EXTENT_SIZE;
+    const uint64_t second_tag = 3 * EXTENT_SIZE;
+    uint8_t *extent = new uint8_t[EXTENT_SIZE];
+    uint64_t stored_before, stored_after, fetched_before, fetched_after;
+    char filename[0x100];
+    VSIStatBufL stat;
+
+    for (uint64_t i = 0; i < EXTENT_SIZE; ++i)
+    {
+        extent[i] = static_cast<uint8_t>(i * 7);
+    }
+
+    setenv(S3BD_DEDUP, "1", 1);
+    storage_init("/vsimem");
+
+    // The second copy of the same content is not uploaded again
+    storage_write(first_tag, EXTENT_SIZE, extent);
+    BOOST_TEST(storage_flush(first_tag));
+    storage_write(second_tag, EXTENT_SIZE, extent);
+    storage_metric("remote_bytes_stored", &stored_before);
+    BOOST_TEST(storage_flush(second_tag, true));
+    storage_metric("remote_bytes_stored", &stored_after);
+    BOOST_TEST(stored_after - stored_before < PAGE_SIZE);
+    sprintf(filename, REF_TEMPLATE, "/vsimem", second_tag);
+    BOOST_TEST(VSIStatL(filename, &stat) == 0);
+
+    // The evicted copy is brought back from the one still in the cache
+    storage_metric("remote_bytes_fetched", &fetched_before);
+    memset(extent, 0, EXTENT_SIZE);
+    storage_read(second_tag + PAGE_SIZE, PAGE_SIZE, extent);
+    storage_metric("remote_bytes_fetched", &fetched_after);
+    BOOST_TEST(fetched_after == fetched_before);
+    BOOST_TEST(extent[1] == static_cast<uint8_t>((PAGE_SIZE + 1) * 7));
+    storage_deinit();
+
+    // Both positions read back from storage
+    storage_init("/vsimem");
+    storage_read(first_tag, PAGE_SIZE, extent);
+    BOOST_TEST(extent[3] == 21);
+    storage_read(second_tag + 2 * PAGE_SIZE, PAGE_SIZE, extent);
+    BOOST_TEST(extent[5] == static_cast<uint8_t>((2 * PAGE_SIZE + 5) * 7));
+    storage_deinit();
+    unsetenv(S3BD_DEDUP);
+
+    delete[] extent;
+}
+
+BOOST_AUTO_TEST_CASE(dedup_layout_remount)
+{
+    const char *blockdir = "/vsimem/layout";
+    const uint64_t extent_tag = 5 * EXTENT_SIZE;
+    uint8_t page[PAGE_SIZE];
+    char filename[0x100];
+    char header[0x100] = {};
+    VSIStatBufL stat;
+
+    // Store by content
+    setenv(S3BD_DEDUP, "1", 1);
+    BOOST_TEST(storage_init(blockdir) == 1);
+    memset(page, 0x11, PAGE_SIZE);
+    storage_write(extent_tag, PAGE_SIZE, page);
+    BOOST_TEST(storage_flush(extent_tag, true));
+    storage_deinit();
+    sprintf(filename, VOLUME_TEMPLATE, blockdir);
+    VSILFILE *handle = VSIFOpenL(filename, "r");
+    BOOST_TEST(handle != nullptr);
+    VSIFReadL(header, 1, sizeof(header) - 1, handle);
+    VSIFCloseL(handle);
+    BOOST_TEST(strstr(header, "layout content") != nullptr);
+
+    // A mount without deduplication follows the reference, and
+    // removes it when it stores the extent at its position
+    unsetenv(S3BD_DEDUP);
+    BOOST_TEST(storage_init(blockdir) == 1);
+    storage_read(extent_tag, PAGE_SIZE, page);
+    BOOST_TEST(page[0] == 0x11);
+    memset(page, 0x22, PAGE_SIZE);
+    storage_write(extent_tag, PAGE_SIZE, page);
+    BOOST_TEST(storage_flush(extent_tag, true));
+    sprintf(filename, REF_TEMPLATE, blockdir, extent_tag);
+    BOOST_TEST(VSIStatL(filename, &stat) != 0);
+    storage_deinit();
+
+    // A mount with deduplication reads the new contents, not the old
+    // content that the position used to refer to
+    setenv(S3BD_DEDUP, "1", 1);
+    BOOST_TEST(storage_init(blockdir) == 1);
+    storage_read(extent_tag, PAGE_SIZE, page);
+    BOOST_TEST(page[0] == 0x22);
+    memset(page, 0x44, PAGE_SIZE);
+    storage_write(extent_tag + PAGE_SIZE, PAGE_SIZE, page);
+    BOOST_TEST(storage_flush(extent_tag, true));
+    storage_deinit();
+    unsetenv(S3BD_DEDUP);
+
+    // And both kinds of mount agree on what it now holds
+    BOOST_TEST(storage_init(blockdir) == 1);
+    storage_read(extent_tag, PAGE_SIZE, page);
+    BOOST_TEST(page[0] == 0x22);
+    storage_read(extent_tag + PAGE_SIZE, PAGE_SIZE, page);
+    BOOST_TEST(page[0] == 0x44);
+    storage_deinit();
+}
+
+BOOST_AUTO_TEST_CASE(manifest_absent_extents)
+{
+    const uint64_t absent_tag = 40 * EXTENT_SIZE;
+    const uint64_t stored_tag = 41 * EXTENT_SIZE;
+    uint8_t page[PAGE_SIZE];
+    char filename[0x100];
+    VSIStatBufL stat;
+
+    storage_init("/vsimem");
+
+    // A never-stored extent reads as the fill pattern without being
+    // brought into the scratch file
+    BOOST_TEST(manifest_absent(absent_tag));
+    storage_read(absent_tag + PAGE_SIZE, PAGE_SIZE, page);
+    BOOST_TEST(page[0] == 0x33);
+    BOOST_TEST(residency_next_data(absent_tag) == absent_tag + EXTENT_SIZE);
+
+    // A stored extent is recorded
+    memset(page, 0x77, PAGE_SIZE);
+    storage_write(stored_tag, PAGE_SIZE, page);
+    BOOST_TEST(storage_flush(stored_tag, true));
+    BOOST_TEST(!manifest_absent(stored_tag));
+    storage_deinit();
+
+    // The manifest persists
+    storage_init("/vsimem");
+    BOOST_TEST(!manifest_absent(stored_tag));
+    BOOST_TEST(manifest_absent(absent_tag));
+    storage_deinit();
+
+    // A chunk that the index lists but that cannot be read leaves the
+    // mount without a manifest, rather than with one that is missing
+    // extents
+    sprintf(filename, MANIFEST_TEMPLATE, "/vsimem", 0UL);
+    BOOST_TEST(VSIRename(filename, "/vsimem/chunk") == 0);
+    storage_init("/vsimem");
+    BOOST_TEST(!manifest_absent(stored_tag));
+    BOOST_TEST(!manifest_absent(absent_tag));
+    storage_deinit();
+    BOOST_TEST(VSIRename("/vsimem/chunk", filename) == 0);
+
+    // A missing manifest is rebuilt from the stored extents
+    sprintf(filename, MANIFEST_INDEX_TEMPLATE, "/vsimem");
+    BOOST_TEST(VSIUnlink(filename) == 0);
+    storage_init("/vsimem");
+    BOOST_TEST(VSIStatL(filename, &stat) == 0);
+    BOOST_TEST(!manifest_absent(stored_tag));
+    BOOST_TEST(!manifest_absent(backed_extent_tag));
+    BOOST_TEST(manifest_absent(absent_tag));
+    storage_read(stored_tag, PAGE_SIZE, page);
+    BOOST_TEST(page[0] == 0x77);
+    BOOST_TEST(page[PAGE_SIZE - 1] == 0x77);
+    storage_deinit();
+}
+
+BOOST_AUTO_TEST_CASE(remote_unreadable_extent)
+{
+    const char *blockdir = "/vsimem/unreadable";
+    uint8_t page[PAGE_SIZE];
+    char filename[0x100];
+
+    unset_environment();
+    storage_init(blockdir);
+    freshen_extent(blockdir, backed_extent_tag);
+
+    // An extent that the manifest lists but whose object cannot be
+    // opened fails to read, rather than reading as the fill pattern
+    sprintf(filename, EXTENT_TEMPLATE, blockdir, backed_extent_tag);
+    BOOST_TEST(VSIRename(filename, "/vsimem/unreadable.object") == 0);
+    BOOST_TEST(VSIMkdir(filename, 0755) == 0);
+    BOOST_TEST(!manifest_absent(backed_extent_tag));
+    BOOST_TEST(storage_read(backed_extent_tag, PAGE_SIZE, page) == -EIO);
+
+    // Nor is it stored over
+    memset(page, 0x55, PAGE_SIZE);
+    BOOST_TEST(storage_write(backed_extent_tag + PAGE_SIZE, PAGE_SIZE, page) == PAGE_SIZE);
+    BOOST_TEST(!storage_flush(backed_extent_tag, true));
+
+    // Once it can be opened again, it reads as it was stored
+    BOOST_TEST(VSIRmdir(filename) == 0);
+    BOOST_TEST(VSIRename("/vsimem/unreadable.object", filename) == 0);
+    BOOST_TEST(storage_flush(backed_extent_tag, true));
+    BOOST_TEST(storage_read(backed_extent_tag, PAGE_SIZE, page) == PAGE_SIZE);
+    BOOST_TEST(page[0] == 0xaa);
+    BOOST_TEST(storage_read(backed_extent_tag + PAGE_SIZE, PAGE_SIZE, page) == PAGE_SIZE);
+    BOOST_TEST(page[0] == 0x55);
+
+    storage_deinit();
+}
+
+void *manifest_insert_thread(void *arg)
+{
+    uint64_t first = *reinterpret_cast<uint64_t *>(arg);
+
+    for (uint64_t i = 0; i < 64; ++i)
+    {
+        manifest_insert((first + i * 8) * EXTENT_SIZE);
+    }
+    return nullptr;
+}
+
+BOOST_AUTO_TEST_CASE(manifest_concurrent_inserts)
+{
+    const char *blockdir = "/vsimem/manifest";
+    const int threads = 8;
+    pthread_t thread[threads];
+    uint64_t first[threads];
+    bool all = true;
+
+    // Threads record extents of the same chunks at once, and again in
+    // a chunk that is new
+    storage_init(blockdir);
+    for (int i = 0; i < threads; ++i)
+    {
+        first[i] = i + ((i % 2) ? MANIFEST_CHUNK_EXTENTS : 0);
+        pthread_create(&thread[i], NULL, manifest_insert_thread, &first[i]);
+    }
+    for (int i = 0; i < threads; ++i)
+    {
+        pthread_join(thread[i], NULL);
+    }
+    storage_deinit();
+
+    // Every one of them is in the stored manifest
+    storage_init(blockdir);
+    for (int i = 0; i < threads; ++i)
+    {
+        for (uint64_t j = 0; j < 64; ++j)
+        {
+            all = all && !manifest_absent((first[i] + j * 8) * EXTENT_SIZE);
+        }
+    }
+    BOOST_TEST(all);
+    BOOST_TEST(manifest_absent((MANIFEST_CHUNK_EXTENTS + 2) * EXTENT_SIZE));
     storage_deinit();
 }
@@ -0,0 +1,441 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <cerrno>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+#if defined(HAVE_LIBURING)
+#include <liburing.h>
+#endif
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include "constants.h"
+#include "fullio.h"
+#include "metrics.h"
+#include "uring.h"
+
+#if defined(HAVE_LIBURING)
+
+// A ring must not be used by two threads at once, so every thread that
+// touches the scratch file gets a ring of its own.  The scratch file
+// is registered with each ring (as file 0).  A thread that asks for a
+// transfer buffer also gets an extent-sized one registered (as buffer
+// 0).  The state of a thread is freed when the thread exits; the
+// rings are torn down when the engine is.
+
+typedef struct
+{
+    struct io_uring ring;
+    uint64_t generation; // The engine generation the ring was set up in
+    uint8_t *buffer;     // The registered buffer, or nullptr if there is none
+    bool buffer_tried;   // True once a buffer has been asked for
+    bool usable;         // False if the ring could not be set up, or has failed
+    bool live;           // True while the ring needs to be torn down
+} uring_thread_t;
+
+typedef std::set<uring_thread_t *> uring_threads_t;
+
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t uring_key;
+static uring_threads_t *uring_threads = nullptr;
+static int uring_fd = -1;
+static uint64_t uring_generation = 0; // Changes whenever the rings are torn down
+
+static metric_t &uring_batches = metric_register("uring_batches");
+static metric_t &uring_ops = metric_register("uring_ops");
+static metric_t &uring_fallbacks = metric_register("uring_fallbacks");
+static metric_t &uring_rings = metric_register("uring_rings");
+
+/**
+ * Tear down the ring and buffer of a thread.  The caller must hold
+ * uring_lock.
+ *
+ * @param thread The thread
+ */
+static void uring_teardown(uring_thread_t *thread)
+{
+    if (thread->live)
+    {
+        io_uring_queue_exit(&thread->ring);
+        thread->live = false;
+        uring_rings--;
+    }
+    free(thread->buffer);
+    thread->buffer = nullptr;
+    thread->buffer_tried = false;
+    thread->usable = false;
+}
+
+/**
+ * Give up on the ring of the calling thread.  Its buffer may still be
+ * in use, so it is kept until the ring is torn down.
+ *
+ * @param thread The thread
+ */
+static void uring_fail(uring_thread_t *thread)
+{
+    pthread_mutex_lock(&uring_lock);
+    if (thread->live)
+    {
+        io_uring_queue_exit(&thread->ring);
+        thread->live = false;
+        uring_rings--;
+    }
+    thread->usable = false;
+    pthread_mutex_unlock(&uring_lock);
+}
+
+/**
+ * Free the state of a thread that is exiting.
+ *
+ * @param arg The state
+ */
+static void uring_release(void *arg)
+{
+    auto thread = reinterpret_cast<uring_thread_t *>(arg);
+
+    pthread_mutex_lock(&uring_lock);
+    uring_teardown(thread);
+    if (uring_threads != nullptr)
+    {
+        uring_threads->erase(thread);
+    }
+    pthread_mutex_unlock(&uring_lock);
+    delete thread;
+}
+
+/**
+ * Create the key under which each thread's state is kept.
+ */
+static void uring_key_create()
+{
+    pthread_key_create(&uring_key, uring_release);
+}
+
+/**
+ * Get the ring of the calling thread, setting it up if necessary.
+ *
+ * @return The ring, or nullptr if the engine is not in use or the ring is not usable
+ */
+static uring_thread_t *uring_get()
+{
+    if (uring_fd == -1)
+    {
+        return nullptr;
+    }
+
+    auto thread = reinterpret_cast<uring_thread_t *>(pthread_getspecific(uring_key));
+
+    if (thread != nullptr && thread->generation == uring_generation)
+    {
+        return thread->usable ? thread : nullptr;
+    }
+    if (thread == nullptr)
+    {
+        thread = new uring_thread_t{};
+        pthread_setspecific(uring_key, thread);
+    }
+
+    pthread_mutex_lock(&uring_lock);
+    uring_teardown(thread);
+    thread->generation = uring_generation;
+    thread->usable = thread->live = (io_uring_queue_init(URING_ENTRIES, &thread->ring, 0) == 0);
+    if (thread->live)
+    {
+        uring_rings++;
+    }
+    if (thread->usable && io_uring_register_files(&thread->ring, &uring_fd, 1) != 0)
+    {
+        uring_teardown(thread);
+    }
+    uring_threads->insert(thread);
+    pthread_mutex_unlock(&uring_lock);
+
+    return thread->usable ? thread : nullptr;
+}
+
+/**
+ * Initialize the io_uring engine for the scratch file, if the kernel
+ * allows it.
+ *
+ * @param fd The descriptor of the scratch file
+ * @return True if the engine is in use, false if the synchronous path must be used
+ */
+bool uring_init(int fd)
+{
+    struct io_uring probe;
+
+    if (io_uring_queue_init(1, &probe, 0) != 0)
+    {
+        return false;
+    }
+    io_uring_queue_exit(&probe);
+
+    pthread_once(&uring_key_once, uring_key_create);
+    pthread_mutex_lock(&uring_lock);
+    if (uring_threads == nullptr)
+    {
+        uring_threads = new uring_threads_t{};
+    }
+    uring_fd = fd;
+    uring_generation++;
+    pthread_mutex_unlock(&uring_lock);
+
+    return true;
+}
+
+/**
+ * Deinitialize the io_uring engine.  Nothing may be using the scratch
+ * file.  The rings and buffers of threads that are still running are
+ * torn down; what is left of their state is freed when they exit.
+ */
+void uring_deinit()
+{
+    pthread_mutex_lock(&uring_lock);
+    if (uring_threads != nullptr)
+    {
+        for (auto thread : *uring_threads)
+        {
+            uring_teardown(thread);
+        }
+        uring_threads->clear();
+    }
+    uring_fd = -1;
+    uring_generation++;
+    pthread_mutex_unlock(&uring_lock);
+}
+
+/**
+ * Get the registered buffer of the calling thread, registering one
+ * the first time it is asked for.  Transfers to and from it avoid
+ * mapping the pages on every operation.
+ *
+ * @return An extent-sized buffer, or nullptr if there is none
+ */
+uint8_t *uring_buffer()
+{
+    uring_thread_t *thread = uring_get();
+    void *buffer = nullptr;
+
+    if (thread == nullptr)
+    {
+        return nullptr;
+    }
+    else if (thread->buffer_tried)
+    {
+        return thread->buffer;
+    }
+
+    // Registering the buffer pins it, which may be more than the
+    // locked-memory limit allows; the ring works without it
+    thread->buffer_tried = true;
+    if (posix_memalign(&buffer, PAGE_SIZE, EXTENT_SIZE) == 0)
+    {
+        struct iovec iov = {buffer, EXTENT_SIZE};
+
+        if (io_uring_register_buffers(&thread->ring, &iov, 1) == 0)
+        {
+            thread->buffer = reinterpret_cast<uint8_t *>(buffer);
+        }
+        else
+        {
+            free(buffer);
+        }
+    }
+
+    return thread->buffer;
+}
+
+/**
+ * Read or write several ranges of the scratch file.  The operations
+ * are submitted in batches of up to URING_ENTRIES, and each batch is
+ * waited for with a single system call.  Anything that the ring does
+ * not complete in full (short transfers, errors) is finished
+ * synchronously.
+ *
+ * @param write True to write, false to read
+ * @param count The number of ranges
+ * @param bytes The arrays to transfer to or from
+ * @param sizes The sizes of the ranges
+ * @param offsets The offsets of the ranges in the scratch file
+ * @return False if the engine is not in use, in which case nothing has been done
+ */
+bool uring_rw(bool write, size_t count, void *const *bytes, const size_t *sizes, const uint64_t *offsets)
+{
+    uring_thread_t *thread = uring_get();
+
+    if (thread == nullptr)
+    {
+        return false;
+    }
+
+    std::vector<size_t> transferred(count, 0);
+
+    for (size_t first = 0; first < count && thread->usable; first += URING_ENTRIES)
+    {
+        size_t n = std::min(count - first, URING_ENTRIES);
+
+        for (size_t i = first; i < first + n; ++i)
+        {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&thread->ring);
+            uint8_t *buffer = reinterpret_cast<uint8_t *>(bytes[i]);
+            bool fixed = (thread->buffer != nullptr && buffer >= thread->buffer && buffer + sizes[i] <= thread->buffer + EXTENT_SIZE);
+
+            if (write && fixed)
+            {
+                io_uring_prep_write_fixed(sqe, 0, buffer, sizes[i], offsets[i], 0);
+            }
+            else if (write)
+            {
+                io_uring_prep_write(sqe, 0, buffer, sizes[i], offsets[i]);
+            }
+            else if (fixed)
+            {
+                io_uring_prep_read_fixed(sqe, 0, buffer, sizes[i], offsets[i], 0);
+            }
+            else
+            {
+                io_uring_prep_read(sqe, 0, buffer, sizes[i], offsets[i]);
+            }
+            io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+            io_uring_sqe_set_data(sqe, reinterpret_cast<void *>(i));
+        }
+
+        int submitted = io_uring_submit_and_wait(&thread->ring, n);
+        uring_batches++;
+        uring_ops += n;
+
+        // Reap whatever was submitted before giving up on the ring
+        for (int i = 0; i < submitted; ++i)
+        {
+            struct io_uring_cqe *cqe = nullptr;
+
+            while (io_uring_wait_cqe(&thread->ring, &cqe) == -EINTR)
+            {
+            }
+            size_t index = reinterpret_cast<size_t>(io_uring_cqe_get_data(cqe));
+            transferred[index] = std::max(cqe->res, 0);
+            io_uring_cqe_seen(&thread->ring, cqe);
+        }
+        if (submitted < static_cast<int>(n))
+        {
+            uring_fail(thread);
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (transferred[i] < sizes[i])
+        {
+            uint8_t *buffer = reinterpret_cast<uint8_t *>(bytes[i]) + transferred[i];
+
+            uring_fallbacks++;
+            if (write)
+            {
+                fullpwrite(uring_fd, buffer, sizes[i] - transferred[i], offsets[i] + transferred[i]);
+            }
+            else
+            {
+                fullpread(uring_fd, buffer, sizes[i] - transferred[i], offsets[i] + transferred[i]);
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Punch a hole in the scratch file.
+ *
+ * @param offset The offset of the hole
+ * @param size The size of the hole
+ * @return True if the hole was punched, false if the caller must do it
+ */
+bool uring_punch(uint64_t offset, uint64_t size)
+{
+    uring_thread_t *thread = uring_get();
+    struct io_uring_cqe *cqe = nullptr;
+    int res;
+
+    if (thread == nullptr)
+    {
+        return false;
+    }
+
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&thread->ring);
+    io_uring_prep_fallocate(sqe, 0, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size);
+    io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    if (io_uring_submit_and_wait(&thread->ring, 1) != 1)
+    {
+        uring_fail(thread);
+        return false;
+    }
+    uring_batches++;
+    uring_ops++;
+
+    while (io_uring_wait_cqe(&thread->ring, &cqe) == -EINTR)
+    {
+    }
+    res = cqe->res;
+    io_uring_cqe_seen(&thread->ring, cqe);
+
+    return (res == 0);
+}
+
+#else
+
+bool uring_init(int fd)
+{
+    return false;
+}
+
+void uring_deinit()
+{
+}
+
+uint8_t *uring_buffer()
+{
+    return nullptr;
+}
+
+bool uring_rw(bool write, size_t count, void *const *bytes, const size_t *sizes, const uint64_t *offsets)
+{
+    return false;
+}
+
+bool uring_punch(uint64_t offset, uint64_t size)
+{
+    return false;
+}
+
+#endif
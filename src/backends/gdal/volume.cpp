@@ -0,0 +1,276 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+
+#include <pthread.h>
+
+#include <gdal.h>
+#include <cpl_vsi.h>
+
+#include "constants.h"
+#include "volume.h"
+
+// The extent size of a volume is chosen when the volume is created
+// and recorded in a small header object, which every later mount
+// reads.  It is always a power of two, so tags, offsets and indices
+// are still computed with masks and shifts.
+//
+// The header also records the layout of the volume.  Once any mount
+// has stored an extent by content, positions may hold references, and
+// every later mount must follow them whether or not it stores by
+// content itself.
+
+uint64_t PAGES_PER_EXTENT = EXTENT_DEFAULT_PAGES;
+uint64_t EXTENT_SIZE = PAGE_SIZE * EXTENT_DEFAULT_PAGES;
+uint64_t EXTENT_MASK = (PAGE_SIZE * EXTENT_DEFAULT_PAGES) - 1;
+uint64_t EXTENT_SHIFT = __builtin_ctzll(PAGE_SIZE * EXTENT_DEFAULT_PAGES);
+
+static const char *volume_format = "s3bd volume 1\npage_size %lu\nextent_size %lu\n";
+static const char *volume_layout_content = "layout content\n";
+static const char *volume_layout_position = "layout position\n";
+
+static pthread_mutex_t volume_lock = PTHREAD_MUTEX_INITIALIZER;
+static char volume_filename[0x100] = {};
+static bool volume_content = false;
+
+/**
+ * Set the extent geometry.
+ *
+ * @param pages The number of pages in an extent
+ */
+static void volume_set(uint64_t pages)
+{
+    PAGES_PER_EXTENT = pages;
+    EXTENT_SIZE = PAGE_SIZE * pages;
+    EXTENT_MASK = EXTENT_SIZE - 1;
+    EXTENT_SHIFT = __builtin_ctzll(EXTENT_SIZE);
+}
+
+/**
+ * Determine whether the storage directory already holds a volume
+ * (one from before volumes had headers, or from before headers
+ * recorded the layout), and whether any position refers to content.
+ *
+ * @param blockdir The storage directory
+ * @param refs The return pointer for whether there are references
+ * @param header The return pointer for whether the listing includes a header
+ * @return A boolean indicating whether there are extents or a manifest there
+ */
+static bool volume_exists(const char *blockdir, bool *refs, bool *header)
+{
+    char **names = VSIReadDir(blockdir);
+    const char *basename = strrchr(volume_filename, '/') + 1;
+    bool exists = false;
+
+    *refs = *header = false;
+    for (char **name = names; name != NULL && *name != NULL; ++name)
+    {
+        const char *suffix = strrchr(*name, '.');
+        *refs = *refs || (suffix != NULL && strcmp(suffix, ".ref") == 0);
+        *header = *header || (strcmp(*name, basename) == 0);
+        exists = exists ||
+                 *refs ||
+                 (suffix != NULL &&
+                  (strcmp(suffix, ".extent") == 0 ||
+                   strcmp(suffix, ".manifest") == 0));
+    }
+    CSLDestroy(names);
+
+    return exists;
+}
+
+/**
+ * Write the header, with the current geometry and layout.
+ *
+ * @return A boolean indicating success or failure
+ */
+static bool volume_write()
+{
+    char header[0x100];
+    VSILFILE *handle = NULL;
+
+    sprintf(header, volume_format, PAGE_SIZE, EXTENT_SIZE);
+    strcat(header, volume_content ? volume_layout_content : volume_layout_position);
+    if ((handle = VSIFOpenL(volume_filename, "w")) != NULL)
+    {
+        bool ok = (VSIFWriteL(header, strlen(header), 1, handle) == 1);
+        VSIFFlushL(handle);
+        return ((VSIFCloseL(handle) == 0) && ok);
+    }
+    return false;
+}
+
+/**
+ * Initialize the volume geometry and layout.  If the volume has a
+ * header, the extent size recorded there is used.  Otherwise the
+ * volume is new and its extent size is taken from the
+ * S3BD_EXTENT_KILOBYTES environment variable (rounded down to a power
+ * of two between EXTENT_MIN_PAGES and EXTENT_MAX_PAGES pages), unless
+ * it already holds extents, in which case it has the default size,
+ * and the header is written.  A header that exists is never written
+ * here: if it cannot be read, or if it cannot be told whether there
+ * is one, the volume is not mounted.  A volume whose header does not
+ * record its layout is searched for references.
+ *
+ * @param blockdir The storage directory
+ * @return A boolean indicating whether the geometry is known
+ */
+bool volume_init(const char *blockdir)
+{
+    char header[0x100] = {};
+    uint64_t page_size = 0, extent_size = 0;
+    uint64_t pages = EXTENT_DEFAULT_PAGES;
+    VSILFILE *handle = NULL;
+    VSIStatBufL stat;
+    const char *str;
+    bool exists, refs, listed;
+
+    sprintf(volume_filename, VOLUME_TEMPLATE, blockdir);
+    volume_content = false;
+
+    // An existing header is authoritative
+    errno = 0;
+    if (VSIStatL(volume_filename, &stat) == 0)
+    {
+        if ((handle = VSIFOpenL(volume_filename, "r")) == NULL)
+        {
+            return false;
+        }
+        VSIFReadL(header, 1, sizeof(header) - 1, handle);
+        VSIFCloseL(handle);
+        if (sscanf(header, volume_format, &page_size, &extent_size) != 2 ||
+            page_size != PAGE_SIZE ||
+            extent_size % PAGE_SIZE != 0)
+        {
+            return false;
+        }
+        pages = extent_size / PAGE_SIZE;
+        if (pages < EXTENT_MIN_PAGES || pages > EXTENT_MAX_PAGES || (pages & (pages - 1)) != 0)
+        {
+            return false;
+        }
+        volume_set(pages);
+        if (strstr(header, volume_layout_content) != nullptr)
+        {
+            volume_content = true;
+        }
+        else if (strstr(header, volume_layout_position) == nullptr)
+        {
+            volume_exists(blockdir, &volume_content, &listed);
+        }
+        return true;
+    }
+    else if (errno != 0 && errno != ENOENT)
+    {
+        return false;
+    }
+
+    // Not every filesystem says why it could not find the header, so
+    // the listing must agree that there is none
+    exists = volume_exists(blockdir, &refs, &listed);
+    if (listed)
+    {
+        return false;
+    }
+
+    // Choose the geometry of a new volume
+    if ((str = getenv(S3BD_EXTENT_KILOBYTES)) != nullptr && !exists)
+    {
+        uint64_t kilobytes = 0;
+
+        sscanf(str, "%lu", &kilobytes);
+        pages = std::max(std::min((kilobytes << 10) / PAGE_SIZE, EXTENT_MAX_PAGES), EXTENT_MIN_PAGES);
+        while ((pages & (pages - 1)) != 0)
+        {
+            pages &= (pages - 1);
+        }
+    }
+    volume_set(pages);
+    volume_content = refs;
+
+    // Record it.  If that is not possible, a volume without a header
+    // is still read correctly as long as it has the default geometry.
+    return (volume_write() || pages == EXTENT_DEFAULT_PAGES);
+}
+
+/**
+ * Whether positions in the volume may refer to content.  If so, a
+ * position's reference must be looked for before its own object.
+ *
+ * @return True if they may
+ */
+bool volume_content_layout()
+{
+    bool content;
+
+    pthread_mutex_lock(&volume_lock);
+    content = volume_content;
+    pthread_mutex_unlock(&volume_lock);
+
+    return content;
+}
+
+/**
+ * Record in the header that positions in the volume may refer to
+ * content.  This must be done before the first reference is stored.
+ * It is the only change ever made to an existing header, and keeps
+ * the geometry that was read from it.
+ *
+ * @return A boolean indicating whether it is recorded
+ */
+bool volume_use_content_layout()
+{
+    bool content;
+
+    pthread_mutex_lock(&volume_lock);
+    if (!volume_content)
+    {
+        volume_content = true;
+        if (!volume_write())
+        {
+            volume_content = false;
+        }
+    }
+    content = volume_content;
+    pthread_mutex_unlock(&volume_lock);
+
+    return content;
+}
+
+/**
+ * Deinitialize the volume geometry and layout, returning to the
+ * defaults.
+ */
+void volume_deinit()
+{
+    volume_set(EXTENT_DEFAULT_PAGES);
+    volume_content = false;
+}
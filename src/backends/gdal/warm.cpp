@@ -0,0 +1,257 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "constants.h"
+#include "extent.h"
+#include "lru.h"
+#include "remote.h"
+#include "residency.h"
+#include "scratch.h"
+#include "warm.h"
+
+// A persistent cache outlives the mount that filled it.  When storage
+// is deinitialized, the pages of clean extents in the scratch file are
+// recorded, as runs, in a small file beside it together with the
+// generation of the volume.  The next mount trusts the record only if
+// the generation has not changed since, which means that nothing has
+// stored an extent in the meantime; that costs one small read instead
+// of one per extent.  The record is removed as soon as it has been
+// read, so a mount that does not end cleanly leaves nothing behind to
+// be trusted.
+
+constexpr char WARM_MAGIC[8] = {'S', '3', 'B', 'D', 'W', 'A', 'R', 'M'};
+constexpr uint64_t WARM_VERSION = 1;
+
+typedef struct
+{
+    char magic[8];
+    uint64_t version;
+    uint64_t extent_size;
+    uint64_t generation;
+    uint64_t runs;
+    char blockdir[0x100];
+} warm_header_t;
+
+typedef struct
+{
+    uint64_t begin;
+    uint64_t end;
+} warm_run_t;
+
+static bool warm_enabled = false;
+static char warm_blockdir[0x100] = {};
+
+/**
+ * Read the record of a previous mount.
+ *
+ * @param filename The name of the record
+ * @param runs The return pointer for the runs of resident pages
+ * @return A boolean indicating whether the record can be trusted
+ */
+static bool warm_read(const char *filename, std::vector<warm_run_t> *runs)
+{
+    warm_header_t header;
+    FILE *file = fopen(filename, "r");
+    bool ok = false;
+
+    if (file == NULL)
+    {
+        return false;
+    }
+    if (fread(&header, sizeof(header), 1, file) == 1 &&
+        memcmp(header.magic, WARM_MAGIC, sizeof(WARM_MAGIC)) == 0 &&
+        header.version == WARM_VERSION &&
+        header.extent_size == EXTENT_SIZE &&
+        header.generation == remote_generation() &&
+        strncmp(header.blockdir, warm_blockdir, sizeof(header.blockdir)) == 0)
+    {
+        runs->resize(header.runs);
+        ok = (header.runs == 0 || fread(runs->data(), sizeof(warm_run_t), header.runs, file) == header.runs);
+    }
+    fclose(file);
+
+    for (size_t i = 0; ok && i < runs->size(); ++i)
+    {
+        const warm_run_t &run = runs->operator[](i);
+        ok = (run.begin < run.end &&
+              (run.begin & PAGE_MASK) == 0 && (run.end & PAGE_MASK) == 0 &&
+              (run.begin & (~EXTENT_MASK)) == ((run.end - 1) & (~EXTENT_MASK)));
+    }
+
+    return ok;
+}
+
+/**
+ * Write a record of the resident pages of clean extents.
+ *
+ * @param filename The name of the record
+ * @param runs The runs of resident pages
+ * @return A boolean indicating success or failure
+ */
+static bool warm_write(const char *filename, const std::vector<warm_run_t> &runs)
+{
+    char temporary[0x200];
+    warm_header_t header = {};
+    FILE *file = NULL;
+    bool ok;
+
+    memcpy(header.magic, WARM_MAGIC, sizeof(WARM_MAGIC));
+    header.version = WARM_VERSION;
+    header.extent_size = EXTENT_SIZE;
+    header.generation = remote_generation();
+    header.runs = runs.size();
+    snprintf(header.blockdir, sizeof(header.blockdir), "%s", warm_blockdir);
+
+    // Write the record beside its final name, then move it into place
+    if (snprintf(temporary, sizeof(temporary), "%s.tmp", filename) >= static_cast<int>(sizeof(temporary)) ||
+        (file = fopen(temporary, "w")) == NULL)
+    {
+        return false;
+    }
+    ok = (fwrite(&header, sizeof(header), 1, file) == 1 &&
+          (runs.empty() || fwrite(runs.data(), sizeof(warm_run_t), runs.size(), file) == runs.size()));
+    ok = (fflush(file) == 0) && (fdatasync(fileno(file)) == 0) && ok;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(temporary, filename) != 0)
+    {
+        unlink(temporary);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Whether a block directory can be used with the persistent cache (if
+ * there is to be one).  The record names the block directory, so that
+ * a scratch file is only trusted for the directory that filled it; a
+ * name that does not fit in the record would not tell directories
+ * apart.
+ *
+ * @param blockdir The storage directory
+ * @return True if there is no persistent cache or if the name fits
+ */
+bool warm_usable(const char *blockdir)
+{
+    return (getenv(S3BD_PERSISTENT_CACHE) == nullptr || strlen(blockdir) < sizeof(warm_blockdir));
+}
+
+/**
+ * Initialize the persistent cache.  This does nothing unless the
+ * S3BD_PERSISTENT_CACHE environment variable is set.  If the record
+ * left by the previous mount can be trusted, the pages it lists are
+ * marked as present and their extents are reported to the cache;
+ * otherwise the scratch file is emptied.
+ *
+ * @param blockdir The storage directory
+ */
+void warm_init(const char *blockdir)
+{
+    char filename[0x200];
+    std::vector<warm_run_t> runs;
+    std::vector<uint64_t> extent_tags;
+
+    warm_enabled = (getenv(S3BD_PERSISTENT_CACHE) != nullptr);
+    if (!warm_enabled)
+    {
+        return;
+    }
+    snprintf(warm_blockdir, sizeof(warm_blockdir), "%s", blockdir);
+
+    // Read the record, and remove it because the scratch file is
+    // about to change
+    sprintf(filename, WARM_TEMPLATE, scratch_name());
+    bool trusted = warm_read(filename, &runs);
+    unlink(filename);
+
+    if (!trusted)
+    {
+        scratch_clear();
+        return;
+    }
+
+    for (auto &run : runs)
+    {
+        residency_mark(run.begin, run.end);
+        extent_tags.push_back(run.begin & (~EXTENT_MASK));
+    }
+    extent_tags.erase(std::unique(extent_tags.begin(), extent_tags.end()), extent_tags.end());
+    for (auto extent_tag : extent_tags)
+    {
+        lru_report_extent(extent_tag);
+    }
+}
+
+/**
+ * Deinitialize the persistent cache.  Dirty extents are flushed, and
+ * then the pages of clean extents are recorded for the next mount.
+ * Nothing else may be using storage.
+ *
+ * @param flusher The function to call to flush an extent
+ */
+void warm_deinit(bool (*flusher)(uint64_t, bool))
+{
+    char filename[0x200];
+    std::vector<uint64_t> extent_tags;
+    std::vector<warm_run_t> runs;
+
+    if (!warm_enabled)
+    {
+        return;
+    }
+    warm_enabled = false;
+
+    residency_extents(&extent_tags);
+    std::sort(extent_tags.begin(), extent_tags.end());
+    for (auto extent_tag : extent_tags)
+    {
+        uint64_t extent_end = extent_tag + EXTENT_SIZE;
+
+        if (!extent_clean(extent_tag) && !flusher(extent_tag, false))
+        {
+            continue;
+        }
+        for (uint64_t data = residency_next_data(extent_tag); data < extent_end;)
+        {
+            uint64_t hole = std::min(residency_next_hole(data), extent_end);
+            runs.push_back(warm_run_t{data, hole});
+            data = (hole < extent_end) ? residency_next_data(hole) : extent_end;
+        }
+    }
+
+    // The scratch file must be durable before the record is
+    scratch_sync();
+    sprintf(filename, WARM_TEMPLATE, scratch_name());
+    warm_write(filename, runs);
+}
@@ -0,0 +1,295 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <cassert>
+#include <ctime>
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <tuple>
+#include <vector>
+
+#include "constants.h"
+#include "metrics.h"
+#include "writeback.h"
+
+// Each extent has at most one pending request.  Requests that are not
+// in flight are ordered by priority (highest first) and then by age.
+// An extent that is requested again while it is being flushed is not
+// handed to another worker until the flush is done.
+
+typedef struct
+{
+    writeback_priority_t priority;
+    bool should_remove;
+    uint64_t sequence;
+} writeback_entry_t;
+
+typedef std::map<uint64_t, writeback_entry_t> writeback_entries_t;
+typedef std::tuple<int, uint64_t, uint64_t> writeback_key_t; // Negated priority, sequence, tag
+typedef std::set<writeback_key_t> writeback_ready_t;
+typedef std::set<uint64_t> writeback_inflight_t;
+
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeback_ready_cond = PTHREAD_COND_INITIALIZER; // Signalled when a request becomes ready
+static pthread_cond_t writeback_done_cond = PTHREAD_COND_INITIALIZER;  // Signalled when a flush is done
+static pthread_cond_t writeback_wake_cond = PTHREAD_COND_INITIALIZER;  // Signalled when stopping or kicked
+static writeback_entries_t *writeback_entries = nullptr;
+static writeback_ready_t *writeback_ready = nullptr;
+static writeback_inflight_t *writeback_inflight = nullptr;
+static uint64_t writeback_sequence = 0;
+static bool writeback_running = false;
+static bool writeback_kicked = false;
+
+static metric_t &writeback_requests = metric_register("writeback_requests");
+static metric_t &writeback_merged = metric_register("writeback_merged");
+
+/**
+ * Initialize the writeback scheduler.
+ */
+void writeback_init()
+{
+    pthread_mutex_lock(&writeback_lock);
+    if (writeback_entries == nullptr)
+    {
+        writeback_entries = new writeback_entries_t{};
+        writeback_ready = new writeback_ready_t{};
+        writeback_inflight = new writeback_inflight_t{};
+    }
+    writeback_running = true;
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+/**
+ * Deinitialize the writeback scheduler.  Pending requests are
+ * discarded.  Nothing may be using the scheduler.
+ */
+void writeback_deinit()
+{
+    pthread_mutex_lock(&writeback_lock);
+    writeback_running = false;
+    if (writeback_entries != nullptr)
+    {
+        delete writeback_entries;
+        delete writeback_ready;
+        delete writeback_inflight;
+        writeback_entries = nullptr;
+        writeback_ready = nullptr;
+        writeback_inflight = nullptr;
+    }
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+/**
+ * Stop the writeback scheduler: wake everyone waiting on it, and make
+ * writeback_next and writeback_sleep return false from now on.
+ */
+void writeback_stop()
+{
+    pthread_mutex_lock(&writeback_lock);
+    writeback_running = false;
+    pthread_cond_broadcast(&writeback_ready_cond);
+    pthread_cond_broadcast(&writeback_done_cond);
+    pthread_cond_broadcast(&writeback_wake_cond);
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+/**
+ * The ordering key of a request.
+ *
+ * @param extent_tag The tag of the extent
+ * @param entry The request
+ * @return The key
+ */
+static inline writeback_key_t writeback_key(uint64_t extent_tag, const writeback_entry_t &entry)
+{
+    return std::make_tuple(-static_cast<int>(entry.priority), entry.sequence, extent_tag);
+}
+
+/**
+ * Ask for an extent to be flushed.  If it already has a pending
+ * request, the two are merged: the higher priority is kept, and the
+ * extent is removed from the local cache if either asked for that.
+ *
+ * @param extent_tag The tag of the extent
+ * @param priority The priority of the request
+ * @param should_remove Whether the extent should be removed from the scratch file
+ */
+void writeback_request(uint64_t extent_tag, writeback_priority_t priority, bool should_remove)
+{
+    assert(extent_tag == (extent_tag & (~EXTENT_MASK)));
+
+    pthread_mutex_lock(&writeback_lock);
+    auto itr = writeback_entries->find(extent_tag);
+    bool inflight = (writeback_inflight->count(extent_tag) != 0);
+
+    writeback_requests++;
+    if (itr == writeback_entries->end())
+    {
+        itr = writeback_entries->insert(std::make_pair(extent_tag, writeback_entry_t{priority, should_remove, writeback_sequence++})).first;
+    }
+    else
+    {
+        writeback_merged++;
+        if (!inflight)
+        {
+            writeback_ready->erase(writeback_key(extent_tag, itr->second));
+        }
+        itr->second.priority = std::max(itr->second.priority, priority);
+        itr->second.should_remove = itr->second.should_remove || should_remove;
+    }
+    if (!inflight)
+    {
+        writeback_ready->insert(writeback_key(extent_tag, itr->second));
+        pthread_cond_signal(&writeback_ready_cond);
+    }
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+/**
+ * Take the most urgent request that is not already in flight, waiting
+ * for one if there are none.  The caller must call writeback_done
+ * once the extent has been flushed.
+ *
+ * @param extent_tag The return pointer for the tag of the extent
+ * @param should_remove The return pointer for whether to remove the extent from the scratch file
+ * @return True if a request was taken, false if the scheduler has been stopped
+ */
+bool writeback_next(uint64_t *extent_tag, bool *should_remove)
+{
+    pthread_mutex_lock(&writeback_lock);
+    while (writeback_running && writeback_ready->empty())
+    {
+        pthread_cond_wait(&writeback_ready_cond, &writeback_lock);
+    }
+    if (!writeback_running)
+    {
+        pthread_mutex_unlock(&writeback_lock);
+        return false;
+    }
+
+    *extent_tag = std::get<2>(*writeback_ready->begin());
+    writeback_ready->erase(writeback_ready->begin());
+    auto itr = writeback_entries->find(*extent_tag);
+    *should_remove = itr->second.should_remove;
+    writeback_entries->erase(itr);
+    writeback_inflight->insert(*extent_tag);
+    pthread_mutex_unlock(&writeback_lock);
+
+    return true;
+}
+
+/**
+ * Report that a flush taken with writeback_next is done.  If the
+ * extent was requested again in the meantime, that request becomes
+ * ready.
+ *
+ * @param extent_tag The tag of the extent
+ */
+void writeback_done(uint64_t extent_tag)
+{
+    pthread_mutex_lock(&writeback_lock);
+    writeback_inflight->erase(extent_tag);
+    auto itr = writeback_entries->find(extent_tag);
+    if (itr != writeback_entries->end())
+    {
+        writeback_ready->insert(writeback_key(extent_tag, itr->second));
+        pthread_cond_signal(&writeback_ready_cond);
+    }
+    pthread_cond_broadcast(&writeback_done_cond);
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+/**
+ * Wait until none of the given extents has a request pending or in
+ * flight.  If they were all requested before the call, each has been
+ * through a flush that started after its request when this returns
+ * true.
+ *
+ * @param extent_tags The tags of the extents
+ * @return True once they are all done, false if the scheduler has been stopped
+ */
+bool writeback_wait(const std::vector<uint64_t> &extent_tags)
+{
+    bool done = false;
+
+    pthread_mutex_lock(&writeback_lock);
+    while (writeback_running && !done)
+    {
+        done = std::none_of(extent_tags.begin(), extent_tags.end(), [](uint64_t extent_tag) {
+            return (writeback_entries->count(extent_tag) != 0 || writeback_inflight->count(extent_tag) != 0);
+        });
+        if (!done)
+        {
+            pthread_cond_wait(&writeback_done_cond, &writeback_lock);
+        }
+    }
+    pthread_mutex_unlock(&writeback_lock);
+
+    return done;
+}
+
+/**
+ * Cut short the current (or next) writeback_sleep, so that whoever is
+ * looking for work to request looks again now.
+ */
+void writeback_kick()
+{
+    pthread_mutex_lock(&writeback_lock);
+    writeback_kicked = true;
+    pthread_cond_broadcast(&writeback_wake_cond);
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+/**
+ * Sleep for a while, or until the scheduler is kicked or stopped.
+ *
+ * @param ns How long to sleep, in nanoseconds
+ * @return False if the scheduler has been stopped
+ */
+bool writeback_sleep(uint64_t ns)
+{
+    struct timespec deadline;
+    bool running;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    ns += deadline.tv_nsec;
+    deadline.tv_sec += ns / 1000000000;
+    deadline.tv_nsec = ns % 1000000000;
+
+    pthread_mutex_lock(&writeback_lock);
+    if (writeback_running && !writeback_kicked)
+    {
+        pthread_cond_timedwait(&writeback_wake_cond, &writeback_lock, &deadline);
+    }
+    writeback_kicked = false;
+    running = writeback_running;
+    pthread_mutex_unlock(&writeback_lock);
+
+    return running;
+}
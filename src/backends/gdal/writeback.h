@@ -0,0 +1,50 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 James McClain
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __WRITEBACK_H__
+#define __WRITEBACK_H__
+
+#include <cstdint>
+#include <vector>
+
+// Requests for the same extent are merged, keeping the higher priority
+enum writeback_priority_t
+{
+    WRITEBACK_BACKGROUND = 0, // Dirty extents that have become due
+    WRITEBACK_EVICTION = 1,   // Extents leaving the local cache
+    WRITEBACK_SYNC = 2        // Extents that someone is waiting for
+};
+
+void writeback_init();
+void writeback_deinit();
+void writeback_stop();
+void writeback_request(uint64_t extent_tag, writeback_priority_t priority, bool should_remove);
+bool writeback_next(uint64_t *extent_tag, bool *should_remove);
+void writeback_done(uint64_t extent_tag);
+bool writeback_wait(const std::vector<uint64_t> &extent_tags);
+void writeback_kick();
+bool writeback_sleep(uint64_t ns);
+
+#endif
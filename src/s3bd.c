@@ -89,6 +89,7 @@ int main(int argc, char **argv)
     operations.ftruncate = dlsym(handle, "s3bd_ftruncate");
     operations.utimens = dlsym(handle, "s3bd_utimens");
     operations.statfs = dlsym(handle, "s3bd_statfs");
+    operations.destroy = dlsym(handle, "s3bd_destroy");
 
     /* Bind variables in backend library */
     blockdir = dlsym(handle, "blockdir");